@@ -0,0 +1,420 @@
+/* Copyright (c) 2004, 2016, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+/**
+  @file ircon_bench.cc
+
+  @brief
+  Load driver for the IRCON engine: runs N client threads against a
+  table of M devices served by ircon_mock_gateway and reports the
+  p50/p99/p999 latency and throughput of each workload.
+
+  @details
+  The workloads exercise the hot handler calls:
+  - write: UPDATE of one random device per statement, write_update_row
+    and the command path to the gateway.
+  - scan: SELECT of the whole table, rnd_next over all M devices.
+  - churn: FLUSH TABLES of the table followed by a one-row SELECT, the
+    open and close of the handler and its share.
+
+  Latencies are those of whole statements as the client sees them. With
+  --profile the server's own per-call histograms are switched on for the
+  run and INFORMATION_SCHEMA.IRCON_PROFILE is printed after it, which
+  splits a statement into the handler calls it made.
+
+  Usage:<br>
+  ircon_mock_gateway --port 21000 --endpoints 64 --latency-us 2000 &<br>
+  ircon_bench --user root --threads 16 --endpoints 64 --mode all
+*/
+
+#include <mysql.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+enum workload { WORKLOAD_WRITE, WORKLOAD_SCAN, WORKLOAD_CHURN,
+                WORKLOAD_COUNT };
+
+static const char *workload_names[]= { "write", "scan", "churn" };
+
+static const char *opt_host= "127.0.0.1";
+static const char *opt_user= "root";
+static const char *opt_password= NULL;
+static const char *opt_socket= NULL;
+static const char *opt_database= "ircon_bench";
+static const char *opt_durability= NULL;
+static const char *opt_comment= "";
+static unsigned int opt_port= 3306;
+static unsigned long opt_threads= 8;
+static unsigned long opt_endpoints= 16;
+static unsigned long opt_gateway_port= 21000;
+static unsigned long opt_seconds= 10;
+static bool opt_profile= false;
+static bool opt_workloads[WORKLOAD_COUNT];
+
+struct worker
+{
+  pthread_t thread;
+  unsigned int id;
+  enum workload workload;
+  std::vector<unsigned long> samples; ///< Statement latencies, microseconds
+  unsigned long errors;
+  std::string error;
+};
+
+static volatile bool stop;
+
+
+static unsigned long long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: ircon_bench [options]\n"
+          "  --host H --port N --socket S --user U --password P\n"
+          "  --threads N         client threads (8)\n"
+          "  --endpoints M       devices, ircon_mock_gateway ports (16)\n"
+          "  --gateway-port N    first gateway port (21000)\n"
+          "  --seconds N         run time of each workload (10)\n"
+          "  --mode W            write, scan, churn or all (all)\n"
+          "  --durability D      SET GLOBAL ircon_durability first\n"
+          "  --comment C         table COMMENT, e.g. wire_format=binary\n"
+          "  --profile           print INFORMATION_SCHEMA.IRCON_PROFILE\n");
+  exit(1);
+}
+
+
+static MYSQL *bench_connect()
+{
+  MYSQL *mysql= mysql_init(NULL);
+
+  if (!mysql)
+    return NULL;
+  if (!mysql_real_connect(mysql, opt_host, opt_user, opt_password, NULL,
+                          opt_port, opt_socket, 0))
+  {
+    fprintf(stderr, "ircon_bench: cannot connect: %s\n", mysql_error(mysql));
+    mysql_close(mysql);
+    return NULL;
+  }
+  return mysql;
+}
+
+
+/**
+  Run a statement and read its result, if any.
+
+  @return 0, or the error number.
+*/
+static unsigned int query(MYSQL *mysql, const char *statement)
+{
+  MYSQL_RES *result;
+
+  if (mysql_query(mysql, statement))
+    return mysql_errno(mysql);
+  if ((result= mysql_store_result(mysql)))
+    mysql_free_result(result);
+  return mysql_errno(mysql);
+}
+
+
+static bool setup(MYSQL *mysql)
+{
+  char statement[512];
+  std::string insert;
+
+  snprintf(statement, sizeof(statement),
+           "CREATE DATABASE IF NOT EXISTS %s", opt_database);
+  if (query(mysql, statement) || mysql_select_db(mysql, opt_database) ||
+      query(mysql, "DROP TABLE IF EXISTS devices"))
+    return false;
+  snprintf(statement, sizeof(statement),
+           "CREATE TABLE devices (device VARCHAR(64) NOT NULL PRIMARY KEY, "
+           "mode VARCHAR(16), temperature DECIMAL(4,1), power BOOL, "
+           "angle VARCHAR(16)) ENGINE=IRCON COMMENT '%s'", opt_comment);
+  if (query(mysql, statement))
+    return false;
+
+  insert= "INSERT INTO devices VALUES ";
+  for (unsigned long i= 0; i < opt_endpoints; i++)
+  {
+    snprintf(statement, sizeof(statement),
+             "%s('127.0.0.1:%lu', 'cool', 25.0, 1, 'auto')",
+             i ? "," : "", opt_gateway_port + i);
+    insert+= statement;
+  }
+  if (query(mysql, insert.c_str()))
+    return false;
+  if (opt_durability)
+  {
+    snprintf(statement, sizeof(statement),
+             "SET GLOBAL ircon_durability= '%s'", opt_durability);
+    if (query(mysql, statement))
+      return false;
+  }
+  return true;
+}
+
+
+static void *run_worker(void *arg)
+{
+  worker *w= (worker*) arg;
+  unsigned int seed= w->id * 7919 + 1;
+  char statement[256];
+  MYSQL *mysql;
+
+  mysql_thread_init();
+  if (!(mysql= bench_connect()))
+  {
+    w->error= "cannot connect";
+    mysql_thread_end();
+    return NULL;
+  }
+  if (mysql_select_db(mysql, opt_database))
+  {
+    w->error= mysql_error(mysql);
+    mysql_close(mysql);
+    mysql_thread_end();
+    return NULL;
+  }
+
+  while (!stop)
+  {
+    unsigned long long start= now_us();
+    unsigned int error= 0;
+
+    switch (w->workload) {
+    case WORKLOAD_WRITE:
+    {
+      static const char *modes[]= { "cool", "heat", "dry", "fan" };
+      unsigned long device= rand_r(&seed) % opt_endpoints;
+      snprintf(statement, sizeof(statement),
+               "UPDATE devices SET mode= '%s', temperature= %u.%u "
+               "WHERE device= '127.0.0.1:%lu'",
+               modes[rand_r(&seed) % 4], 18 + rand_r(&seed) % 12,
+               rand_r(&seed) % 10, opt_gateway_port + device);
+      error= query(mysql, statement);
+      break;
+    }
+    case WORKLOAD_SCAN:
+      error= query(mysql, "SELECT * FROM devices");
+      break;
+    case WORKLOAD_CHURN:
+      if (!(error= query(mysql, "FLUSH TABLES devices")))
+        error= query(mysql, "SELECT mode FROM devices LIMIT 1");
+      break;
+    case WORKLOAD_COUNT:
+      break;
+    }
+    if (error)
+    {
+      if (!w->errors++)
+        w->error= mysql_error(mysql);
+      continue;
+    }
+    w->samples.push_back((unsigned long) (now_us() - start));
+  }
+  mysql_close(mysql);
+  mysql_thread_end();
+  return NULL;
+}
+
+
+static unsigned long percentile(const std::vector<unsigned long> &sorted,
+                                double fraction)
+{
+  size_t i;
+
+  if (sorted.empty())
+    return 0;
+  i= (size_t) (fraction * sorted.size());
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+
+static void print_profile(MYSQL *mysql)
+{
+  MYSQL_RES *result;
+  MYSQL_ROW row;
+
+  if (mysql_query(mysql, "SELECT OPERATION, CALLS, LATENCY_P50_NS, "
+                  "LATENCY_P99_NS, LATENCY_P999_NS "
+                  "FROM INFORMATION_SCHEMA.IRCON_PROFILE") ||
+      !(result= mysql_store_result(mysql)))
+  {
+    fprintf(stderr, "ircon_bench: IRCON_PROFILE: %s\n", mysql_error(mysql));
+    return;
+  }
+  printf("  %-12s %12s %12s %12s %12s\n", "call", "calls", "p50 ns",
+         "p99 ns", "p999 ns");
+  while ((row= mysql_fetch_row(result)))
+    printf("  %-12s %12s %12s %12s %12s\n", row[0], row[1],
+           row[2] ? row[2] : "-", row[3] ? row[3] : "-",
+           row[4] ? row[4] : "-");
+  mysql_free_result(result);
+}
+
+
+/**
+  Run one workload on opt_threads threads for opt_seconds and print its
+  latencies.
+
+  @return false if no statement succeeded.
+*/
+static bool run_workload(MYSQL *mysql, enum workload workload)
+{
+  std::vector<worker> workers(opt_threads);
+  std::vector<unsigned long> samples;
+  unsigned long long start, elapsed;
+  unsigned long errors= 0;
+
+  if (opt_profile)
+  {
+    /* Setting it to ON again starts the histograms from zero */
+    query(mysql, "SET GLOBAL ircon_profile= OFF");
+    query(mysql, "SET GLOBAL ircon_profile= ON");
+  }
+  stop= false;
+  start= now_us();
+  for (unsigned long i= 0; i < opt_threads; i++)
+  {
+    workers[i].id= (unsigned int) i;
+    workers[i].workload= workload;
+    workers[i].errors= 0;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  while (!stop && now_us() - start < opt_seconds * 1000000ULL)
+  {
+    struct timespec tick= { 0, 100000000 };
+    nanosleep(&tick, NULL);
+  }
+  stop= true;
+  for (unsigned long i= 0; i < opt_threads; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    samples.insert(samples.end(), workers[i].samples.begin(),
+                   workers[i].samples.end());
+    errors+= workers[i].errors;
+    if (!workers[i].error.empty() && workers[i].samples.empty())
+      fprintf(stderr, "ircon_bench: %s thread %lu: %s\n",
+              workload_names[workload], i, workers[i].error.c_str());
+  }
+  elapsed= now_us() - start;
+  std::sort(samples.begin(), samples.end());
+
+  printf("%-6s threads %lu endpoints %lu: %lu statements, %lu errors, "
+         "%.0f/s, p50 %lu us, p99 %lu us, p999 %lu us\n",
+         workload_names[workload], opt_threads, opt_endpoints,
+         (unsigned long) samples.size(), errors,
+         samples.size() * 1000000.0 / elapsed,
+         percentile(samples, 0.50), percentile(samples, 0.99),
+         percentile(samples, 0.999));
+  if (opt_profile)
+  {
+    print_profile(mysql);
+    query(mysql, "SET GLOBAL ircon_profile= OFF");
+  }
+  fflush(stdout);
+  return !samples.empty();
+}
+
+
+int main(int argc, char **argv)
+{
+  bool any= false;
+  bool ok= true;
+  MYSQL *mysql;
+
+  for (int i= 1; i < argc; i++)
+  {
+    const char *option= argv[i];
+    if (!strcmp(option, "--profile"))
+    {
+      opt_profile= true;
+      continue;
+    }
+    if (i + 1 >= argc)
+      usage();
+    const char *value= argv[++i];
+    if (!strcmp(option, "--host"))
+      opt_host= value;
+    else if (!strcmp(option, "--port"))
+      opt_port= (unsigned int) strtoul(value, NULL, 10);
+    else if (!strcmp(option, "--socket"))
+      opt_socket= value;
+    else if (!strcmp(option, "--user"))
+      opt_user= value;
+    else if (!strcmp(option, "--password"))
+      opt_password= value;
+    else if (!strcmp(option, "--threads"))
+      opt_threads= strtoul(value, NULL, 10);
+    else if (!strcmp(option, "--endpoints"))
+      opt_endpoints= strtoul(value, NULL, 10);
+    else if (!strcmp(option, "--gateway-port"))
+      opt_gateway_port= strtoul(value, NULL, 10);
+    else if (!strcmp(option, "--seconds"))
+      opt_seconds= strtoul(value, NULL, 10);
+    else if (!strcmp(option, "--durability"))
+      opt_durability= value;
+    else if (!strcmp(option, "--comment"))
+      opt_comment= value;
+    else if (!strcmp(option, "--mode"))
+    {
+      bool found= false;
+      for (int w= 0; w < WORKLOAD_COUNT; w++)
+        if (!strcmp(value, "all") || !strcmp(value, workload_names[w]))
+          found= opt_workloads[w]= true;
+      if (!found)
+        usage();
+      any= true;
+    }
+    else
+      usage();
+  }
+  if (!opt_threads || !opt_endpoints)
+    usage();
+  if (!any)
+    for (int w= 0; w < WORKLOAD_COUNT; w++)
+      opt_workloads[w]= true;
+
+  if (mysql_library_init(0, NULL, NULL))
+    return 1;
+  if (!(mysql= bench_connect()))
+    return 1;
+  if (!setup(mysql))
+  {
+    fprintf(stderr, "ircon_bench: setup failed: %s\n", mysql_error(mysql));
+    mysql_close(mysql);
+    return 1;
+  }
+  for (int w= 0; w < WORKLOAD_COUNT; w++)
+    if (opt_workloads[w])
+      ok= run_workload(mysql, (enum workload) w) && ok;
+  mysql_close(mysql);
+  mysql_library_end();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,404 @@
+/* Copyright (c) 2004, 2016, Oracle and/or its affiliates. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
+
+/**
+  @file ircon_mock_gateway.cc
+
+  @brief
+  A gateway for ircon_bench: listens on a range of TCP ports, one per
+  device, and answers the IRCON protocol with a configurable delay.
+
+  @details
+  Text lines and IRCON_FRAME_MAGIC frames are both accepted. A command
+  carrying a sequence number, "seq:N," or an IRCON_FRAME_SEQ entry, is
+  answered with "ack:N" and a "?" state query with the last text line the
+  port got, so ircon_pipeline_window and ircon_state_max_age can be
+  measured as well. Every answer is held back by --latency-us plus up to
+  --jitter-us microseconds, and answers to one connection keep their
+  order.
+
+  Usage:<br>
+  ircon_mock_gateway [--port 21000] [--endpoints 16] [--latency-us 2000]
+  [--jitter-us 0]
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#define FRAME_MAGIC 0x80
+#define FRAME_SEQ 0xff
+#define MAX_EVENTS 64
+
+static const char *default_state= "mode:cool,temperature:25.0,power:1,";
+
+struct client
+{
+  int fd;
+  int port;                   ///< Index of the listening port
+  unsigned long long id;      ///< Tells a reused fd apart in the reply queue
+  unsigned long long last_due;
+  std::string input;
+  std::string output;
+};
+
+struct reply
+{
+  unsigned long long due;
+  unsigned long long id;
+  std::string line;
+  bool operator<(const reply &other) const { return due > other.due; }
+};
+
+static unsigned long opt_port= 21000;
+static unsigned long opt_endpoints= 16;
+static unsigned long opt_latency_us= 2000;
+static unsigned long opt_jitter_us= 0;
+
+static int epoll_fd;
+static std::vector<int> listen_fds;
+static std::vector<std::string> port_state;
+static std::map<unsigned long long, client*> clients;
+static std::priority_queue<reply> replies;
+static unsigned long long next_id= 1;
+
+
+static unsigned long long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: ircon_mock_gateway [--port N] [--endpoints N] "
+          "[--latency-us N] [--jitter-us N]\n"
+          "Answers the IRCON protocol on ports port..port+endpoints-1.\n");
+  exit(1);
+}
+
+
+static void update_events(client *c)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events= EPOLLIN;
+  if (!c->output.empty())
+    event.events|= EPOLLOUT;
+  event.data.u64= c->id;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+
+static void close_client(client *c)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  clients.erase(c->id);
+  delete c;
+}
+
+
+/**
+  Write what can be written of the client's output.
+
+  @return false if the client was closed.
+*/
+static bool flush_client(client *c)
+{
+  while (!c->output.empty())
+  {
+    ssize_t n= send(c->fd, c->output.data(), c->output.size(), MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      close_client(c);
+      return false;
+    }
+    c->output.erase(0, n);
+  }
+  update_events(c);
+  return true;
+}
+
+
+/**
+  Hold an answer back for the configured latency. Answers never overtake
+  one another on a connection, the gateway of a real device answers in
+  order too.
+*/
+static void queue_reply(client *c, const std::string &line)
+{
+  reply r;
+  unsigned long long due= now_us() + opt_latency_us;
+
+  if (opt_jitter_us)
+    due+= (unsigned long long) (random() % (opt_jitter_us + 1));
+  if (due < c->last_due)
+    due= c->last_due;
+  c->last_due= due;
+  r.due= due;
+  r.id= c->id;
+  r.line= line;
+  replies.push(r);
+}
+
+
+/**
+  Answer the complete commands in the client's input.
+*/
+static void parse_input(client *c)
+{
+  std::string &in= c->input;
+  size_t pos= 0;
+  char ack[32];
+
+  while (pos < in.size())
+  {
+    if ((unsigned char) in[pos] == FRAME_MAGIC)
+    {
+      if (in.size() - pos < 2)
+        break;
+      size_t length= (unsigned char) in[pos + 1];
+      if (in.size() - pos < 2 + length)
+        break;
+      const unsigned char *payload=
+        (const unsigned char*) in.data() + pos + 2;
+      if (length >= 9 && payload[0] == FRAME_SEQ)
+      {
+        unsigned long long seq= 0;
+        for (int i= 0; i < 8; i++)
+          seq= (seq << 8) | payload[1 + i];
+        snprintf(ack, sizeof(ack), "ack:%llu\n", seq);
+        queue_reply(c, ack);
+      }
+      pos+= 2 + length;
+      continue;
+    }
+
+    size_t newline= in.find('\n', pos);
+    if (newline == std::string::npos)
+      break;
+    std::string line(in, pos, newline - pos);
+    pos= newline + 1;
+    if (line == "?")
+    {
+      queue_reply(c, port_state[c->port] + "\n");
+      continue;
+    }
+    if (!line.compare(0, 4, "seq:"))
+    {
+      size_t comma= line.find(',');
+      snprintf(ack, sizeof(ack), "ack:%llu\n",
+               strtoull(line.c_str() + 4, NULL, 10));
+      queue_reply(c, ack);
+      line.erase(0, comma == std::string::npos ? line.size() : comma + 1);
+    }
+    if (!line.empty())
+      port_state[c->port]= line;
+  }
+  in.erase(0, pos);
+}
+
+
+static void accept_client(int port)
+{
+  struct epoll_event event;
+  int one= 1;
+  int fd;
+
+  while ((fd= accept(listen_fds[port], NULL, NULL)) >= 0)
+  {
+    client *c= new client();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd= fd;
+    c->port= port;
+    c->id= next_id++;
+    c->last_due= 0;
+    clients[c->id]= c;
+    memset(&event, 0, sizeof(event));
+    event.events= EPOLLIN;
+    event.data.u64= c->id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+
+static void read_client(client *c)
+{
+  char buffer[4096];
+
+  for (;;)
+  {
+    ssize_t n= recv(c->fd, buffer, sizeof(buffer), 0);
+    if (n > 0)
+    {
+      c->input.append(buffer, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    close_client(c);
+    return;
+  }
+  parse_input(c);
+}
+
+
+/**
+  Write the answers that are due.
+
+  @return Milliseconds until the next one, -1 if none is queued.
+*/
+static int send_replies()
+{
+  unsigned long long now= now_us();
+  std::vector<client*> touched;
+
+  while (!replies.empty() && replies.top().due <= now)
+  {
+    std::map<unsigned long long, client*>::iterator it=
+      clients.find(replies.top().id);
+    if (it != clients.end())
+    {
+      if (it->second->output.empty())
+        touched.push_back(it->second);
+      it->second->output+= replies.top().line;
+    }
+    replies.pop();
+  }
+  for (size_t i= 0; i < touched.size(); i++)
+    flush_client(touched[i]);
+  if (replies.empty())
+    return -1;
+  return (int) ((replies.top().due - now + 999) / 1000);
+}
+
+
+int main(int argc, char **argv)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int one= 1;
+
+  for (int i= 1; i < argc; i++)
+  {
+    if (i + 1 >= argc)
+      usage();
+    if (!strcmp(argv[i], "--port"))
+      opt_port= strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--endpoints"))
+      opt_endpoints= strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--latency-us"))
+      opt_latency_us= strtoul(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--jitter-us"))
+      opt_jitter_us= strtoul(argv[++i], NULL, 10);
+    else
+      usage();
+  }
+  if (!opt_endpoints || opt_port + opt_endpoints > 65536)
+    usage();
+
+  signal(SIGPIPE, SIG_IGN);
+  if ((epoll_fd= epoll_create(MAX_EVENTS)) < 0)
+  {
+    perror("epoll_create");
+    return 1;
+  }
+  for (unsigned long i= 0; i < opt_endpoints; i++)
+  {
+    struct sockaddr_in addr;
+    struct epoll_event event;
+    int fd= socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family= AF_INET;
+    addr.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+    addr.sin_port= htons((unsigned short) (opt_port + i));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+        listen(fd, 128))
+    {
+      fprintf(stderr, "ircon_mock_gateway: cannot listen on port %lu: %s\n",
+              opt_port + i, strerror(errno));
+      return 1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    listen_fds.push_back(fd);
+    port_state.push_back(default_state);
+    memset(&event, 0, sizeof(event));
+    event.events= EPOLLIN;
+    /* Listening sockets are told apart from clients, whose ids start at 1 */
+    event.data.u64= ~(unsigned long long) i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+  printf("ircon_mock_gateway: ports %lu-%lu, latency %lu us, jitter %lu us\n",
+         opt_port, opt_port + opt_endpoints - 1, opt_latency_us,
+         opt_jitter_us);
+  fflush(stdout);
+
+  for (;;)
+  {
+    int timeout= send_replies();
+    int n= epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      return 1;
+    }
+    for (int i= 0; i < n; i++)
+    {
+      unsigned long long id= events[i].data.u64;
+      if (id > ~(unsigned long long) opt_endpoints)
+      {
+        accept_client((int) ~id);
+        continue;
+      }
+      std::map<unsigned long long, client*>::iterator it= clients.find(id);
+      if (it == clients.end())
+        continue;
+      client *c= it->second;
+      if ((events[i].events & EPOLLOUT) && !flush_client(c))
+        continue;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        read_client(c);
+    }
+  }
+  return 0;
+}
@@ -94,11 +94,33 @@
 
 #include "table.h"
 #include "field.h"
+#include "my_atomic.h"
+#include "hash.h"
+#include "sql_show.h"                   // schema_table_store_record
+#include "tztime.h"                     // Time_zone
+#include "log.h"                        // sql_print_error
+#include "item_cmpfunc.h"               // Item_cond
+#include "my_rdtsc.h"                   // my_timer_nanoseconds
+#include "mysql/psi/mysql_stage.h"      // PSI_stage_info
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SCHED_GETCPU
+#include <sched.h>
+#endif
 
 static handler *ircon_create_handler(handlerton *hton,
                                        TABLE_SHARE *table, 
@@ -106,401 +128,5902 @@ static handler *ircon_create_handler(handlerton *hton,
 
 handlerton *ircon_hton;
 
+/*
+  Number of send() calls avoided by building each command line in one
+  buffer, compared to sending field name, ":", value and "," separately.
+*/
+static int64 ircon_send_syscalls_saved= 0;
+
+/* Batched commands that were replaced by a later row for the same device */
+static int64 ircon_batch_commands_collapsed= 0;
+
+/* Source of ha_ircon::batch_id, 0 meaning no batch */
+static int64 ircon_next_batch_id= 0;
+
+#define IRCON_COUNTER_STRIPES 16
+
+/** @brief
+  A counter split over cache lines, so that threads on different CPUs
+  adding to it do not contend on one line. Reading it sums the stripes.
+*/
+class Ircon_counter
+{
+  struct Stripe
+  {
+    int64 value;
+    char pad[CPU_LEVEL1_DCACHE_LINESIZE - sizeof(int64)];
+  };
+  Stripe stripes[IRCON_COUNTER_STRIPES];
+
+  static uint stripe()
+  {
+#ifdef HAVE_SCHED_GETCPU
+    int cpu= sched_getcpu();
+    if (cpu >= 0)
+      return (uint) cpu % IRCON_COUNTER_STRIPES;
+#endif
+    return (uint) (my_thread_self_id() % IRCON_COUNTER_STRIPES);
+  }
+
+public:
+  void add(int64 n)
+  {
+    my_atomic_add64(&stripes[stripe()].value, n);
+  }
+
+  longlong sum()
+  {
+    longlong total= 0;
+    for (uint i= 0; i < IRCON_COUNTER_STRIPES; i++)
+      total+= my_atomic_load64(&stripes[i].value);
+    return total;
+  }
+};
+
+/* Command lines and their bytes handed to the kernel */
+static Ircon_counter ircon_commands_sent;
+static Ircon_counter ircon_bytes_sent;
+
+static int64 ircon_connect_attempts= 0;
+static int64 ircon_connect_failures= 0;
+/* Connects of an endpoint that had been connected before */
+static int64 ircon_reconnects= 0;
+
+/* Asynchronous commands not written yet or deferred, over all connections */
+static volatile int64 ircon_output_depth= 0;
+
+/* Circuit breakers not closed, times one opened, commands it rejected */
+static int64 ircon_breakers_open= 0;
+static int64 ircon_breaker_trips= 0;
+static int64 ircon_breaker_rejects= 0;
+/* Connects the health checker tried on endpoints with an open breaker */
+static int64 ircon_health_checks= 0;
+
+static ulong srv_breaker_threshold= 3;
+
+static MYSQL_SYSVAR_ULONG(
+  breaker_threshold,
+  srv_breaker_threshold,
+  PLUGIN_VAR_RQCMDARG,
+  "Consecutive connect failures that open the circuit breaker of a device "
+  "endpoint. While it is open, commands to the endpoint fail at once and "
+  "only the health checker tries to connect. 0 never opens it.",
+  NULL,
+  NULL,
+  3,
+  0,
+  1000,
+  0);
+
+static ulong srv_health_check_interval= 5000;
+
+static MYSQL_SYSVAR_ULONG(
+  health_check_interval,
+  srv_health_check_interval,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds between health check connects to an endpoint with an open "
+  "circuit breaker. Connected endpoints get TCP keepalive probes at this "
+  "interval, rounded to seconds.",
+  NULL,
+  NULL,
+  5000,
+  100,
+  3600000,
+  0);
+
+static ulong srv_resolve_ttl= 300;
+
+static MYSQL_SYSVAR_ULONG(
+  resolve_ttl,
+  srv_resolve_ttl,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds a resolved device host name is used before it is resolved "
+  "again in the background. 0 resolves a name only once.",
+  NULL,
+  NULL,
+  300,
+  0,
+  7 * 24 * 3600,
+  0);
+
+/* getaddrinfo() lookups of device host names, and those that failed */
+static int64 ircon_resolves= 0;
+static int64 ircon_resolve_failures= 0;
+
+/* Send latency histogram of all endpoints */
+static int64 ircon_send_latency[IRCON_LATENCY_BUCKETS];
+
+static uint ircon_latency_bucket(ulonglong usec,
+                                 uint buckets= IRCON_LATENCY_BUCKETS)
+{
+  uint bucket= 0;
+  while (usec && bucket < buckets - 1)
+  {
+    usec>>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+/*
+  Handler call latency histograms, see ircon_profile: bucket i counts
+  calls that took less than 2^i nanoseconds, the last bucket all slower
+  ones.
+*/
+#define IRCON_PROFILE_BUCKETS 32
+
+enum ircon_operation
+{
+  IRCON_OPERATION_OPEN,
+  IRCON_OPERATION_CLOSE,
+  IRCON_OPERATION_WRITE,        ///< write_row() and update_row()
+  IRCON_OPERATION_READ,         ///< rnd_next()
+  IRCON_OPERATION_SCAN,         ///< rnd_init() to rnd_end()
+  IRCON_OPERATION_COUNT
+};
+
+static const char *ircon_operation_names[]=
+  {"open", "close", "write", "rnd_next", "scan"};
+
+static int64 ircon_profile_latency[IRCON_OPERATION_COUNT]
+                                  [IRCON_PROFILE_BUCKETS];
+
+static my_bool srv_profile= FALSE;
+
+/* Switching profiling on starts the histograms over */
+static void ircon_profile_update(MYSQL_THD thd, struct st_mysql_sys_var *var,
+                                 void *var_ptr, const void *save)
+{
+  if ((*(my_bool*) var_ptr= *(const my_bool*) save))
+    for (uint i= 0; i < IRCON_OPERATION_COUNT; i++)
+      for (uint j= 0; j < IRCON_PROFILE_BUCKETS; j++)
+        my_atomic_store64(&ircon_profile_latency[i][j], 0);
+}
+
+static MYSQL_SYSVAR_BOOL(
+  profile,
+  srv_profile,
+  PLUGIN_VAR_OPCMDARG,
+  "Time the open, close, write, rnd_next and scan calls of IRCON tables "
+  "into the histograms of INFORMATION_SCHEMA.IRCON_PROFILE. Setting it to "
+  "ON clears them.",
+  NULL,
+  ircon_profile_update,
+  FALSE);
+
+/**
+  @brief
+  Start timing a handler call.
+
+  @return
+    The start time to pass to ircon_profile_end(), 0 if not profiling.
+*/
+static inline ulonglong ircon_profile_start()
+{
+  return srv_profile ? my_timer_nanoseconds() : 0;
+}
+
+static inline void ircon_profile_end(enum ircon_operation operation,
+                                     ulonglong start)
+{
+  if (start)
+    my_atomic_add64(&ircon_profile_latency[operation]
+                      [ircon_latency_bucket(my_timer_nanoseconds() - start,
+                                            IRCON_PROFILE_BUCKETS)], 1);
+}
+
+/* Time constant of Ircon_connection::send_rate, in seconds */
+#define IRCON_RATE_WINDOW 60.0
+
+static ulong srv_connect_timeout= 3000;
+
+static MYSQL_SYSVAR_ULONG(
+  connect_timeout,
+  srv_connect_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds to wait for a device to accept a connection.",
+  NULL,
+  NULL,
+  3000,
+  1,
+  600000,
+  0);
+
+static MYSQL_THDVAR_BOOL(
+  batch_commands,
+  PLUGIN_VAR_OPCMDARG,
+  "Queue device commands during a statement and send only the last state "
+  "of each device when the statement ends.",
+  NULL,
+  NULL,
+  FALSE);
+
+static ulong srv_bulk_flush_devices= 1024;
+
+static MYSQL_SYSVAR_ULONG(
+  bulk_flush_devices,
+  srv_bulk_flush_devices,
+  PLUGIN_VAR_RQCMDARG,
+  "Devices a multi-row INSERT or LOAD DATA collects before it sends their "
+  "commands, which it otherwise does at the end of the insert.",
+  NULL,
+  NULL,
+  1024,
+  1,
+  1024 * 1024,
+  0);
+
+static ulong srv_rate_limit= 0;
+
+static MYSQL_SYSVAR_ULONG(
+  rate_limit,
+  srv_rate_limit,
+  PLUGIN_VAR_RQCMDARG,
+  "Commands per second sent to an endpoint. A command over the limit waits "
+  "in the event loop, replaced by any newer command for the endpoint. "
+  "0 does not limit. A rate_limit=N table COMMENT overrides it.",
+  NULL,
+  NULL,
+  0,
+  0,
+  1000,
+  0);
+
+static ulong srv_rate_burst= 1;
+
+static MYSQL_SYSVAR_ULONG(
+  rate_burst,
+  srv_rate_burst,
+  PLUGIN_VAR_RQCMDARG,
+  "Commands an endpoint under ircon_rate_limit may be sent back to back "
+  "after being idle.",
+  NULL,
+  NULL,
+  1,
+  1,
+  1000,
+  0);
+
+static ulong srv_schedule_batch= 32;
+
+static MYSQL_SYSVAR_ULONG(
+  schedule_batch,
+  srv_schedule_batch,
+  PLUGIN_VAR_RQCMDARG,
+  "Scheduled commands that came due sent per 100 millisecond tick, the "
+  "others are sent in the next ticks.",
+  NULL,
+  NULL,
+  32,
+  1,
+  100000,
+  0);
+
+/* Commands ever scheduled, and those waiting to be sent */
+static int64 ircon_commands_scheduled= 0;
+static volatile int64 ircon_schedule_pending= 0;
+
+/* Rows read from a device's record image, and images built */
+static Ircon_counter ircon_row_image_reads;
+static int64 ircon_row_image_builds= 0;
+
+/*
+  Commands held back by the rate limit, those replaced while waiting, and
+  those dropped when their token came with the circuit breaker open
+*/
+static int64 ircon_commands_deferred= 0;
+static int64 ircon_commands_coalesced= 0;
+static int64 ircon_deferred_dropped= 0;
+
 /* Interface to mysqld, to check system tables supported by SE */
 static const char* ircon_system_database();
 static bool ircon_is_supported_system_table(const char *db,
                                       const char *table_name,
                                       bool is_sql_layer_system_table);
 
-Ircon_share::Ircon_share()
+static ulong srv_pool_max_idle= 300;
+
+static ulong srv_state_max_age= 0;
+
+static MYSQL_SYSVAR_ULONG(
+  state_max_age,
+  srv_state_max_age,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds the device state read back from a gateway is reused by "
+  "reads. 0 does not query gateways and returns the state last written.",
+  NULL,
+  NULL,
+  0,
+  0,
+  86400000,
+  0);
+
+static ulong srv_read_timeout= 1000;
+
+static MYSQL_SYSVAR_ULONG(
+  read_timeout,
+  srv_read_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds to wait for a gateway to answer a state query.",
+  NULL,
+  NULL,
+  1000,
+  1,
+  600000,
+  0);
+
+/* State queries sent to gateways, and those that got no valid answer */
+static int64 ircon_state_queries= 0;
+static int64 ircon_state_query_failures= 0;
+
+/* Commands not sent because the device already had the value */
+static int64 ircon_commands_suppressed= 0;
+
+static ulong srv_dedup_ttl= 0;
+
+static MYSQL_SYSVAR_ULONG(
+  dedup_ttl,
+  srv_dedup_ttl,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds a command sent to a device suppresses sending the same value "
+  "again. 0 sends every command. A dedup_ttl=N table COMMENT overrides it.",
+  NULL,
+  NULL,
+  0,
+  0,
+  86400,
+  0);
+
+static MYSQL_SYSVAR_ULONG(
+  pool_max_idle,
+  srv_pool_max_idle,
+  PLUGIN_VAR_RQCMDARG,
+  "Seconds an unused pooled device connection is kept open. "
+  "0 closes it as soon as no table uses it.",
+  NULL,
+  NULL,
+  300,
+  0,
+  86400,
+  0);
+
+/* Pool of Ircon_connection, keyed by endpoint */
+static HASH ircon_connections;
+/* Set while the pool is initialized, INFORMATION_SCHEMA.IRCON_DEVICES reads it */
+static bool ircon_connections_ready= false;
+static mysql_mutex_t ircon_connections_mutex;
+
+static PSI_memory_key ircon_key_memory_connections;
+static PSI_memory_key ircon_key_memory_command_queue;
+static PSI_memory_key ircon_key_memory_devices;
+static PSI_memory_key ircon_key_memory_state;
+static PSI_memory_key ircon_key_memory_field_commands;
+static PSI_memory_key ircon_key_memory_filter;
+
+/* Stages of a client thread talking to a device */
+static PSI_stage_info ircon_stage_connecting=
+  { 0, "Connecting to device", 0};
+static PSI_stage_info ircon_stage_sending=
+  { 0, "Sending command to device", 0};
+static PSI_stage_info ircon_stage_querying=
+  { 0, "Reading device state", 0};
+static PSI_stage_info ircon_stage_waiting_for_ack=
+  { 0, "Waiting for device ack", 0};
+static PSI_stage_info ircon_stage_waiting_for_output=
+  { 0, "Waiting for queued device commands", 0};
+static PSI_stage_info ircon_stage_waiting_for_rate_limit=
+  { 0, "Waiting for device rate limit", 0};
+
+#ifdef HAVE_PSI_INTERFACE
+static PSI_mutex_key ircon_key_mutex_Ircon_connection_mutex;
+static PSI_mutex_key ircon_key_mutex_ircon_connections;
+static PSI_mutex_key ircon_key_mutex_Ircon_event_loop_mutex;
+static PSI_mutex_key ircon_key_mutex_state_dictionary;
+static PSI_mutex_key ircon_key_mutex_Ircon_journal_mutex;
+static PSI_mutex_key ircon_key_mutex_Ircon_state_file_mutex;
+static PSI_mutex_key ircon_key_mutex_Ircon_share_devices_mutex;
+static PSI_mutex_key ircon_key_mutex_Ircon_device_mutex;
+static PSI_mutex_key ircon_key_mutex_Ircon_resolver_mutex;
+static PSI_mutex_key ircon_key_mutex_Ircon_scheduler_mutex;
+
+static PSI_mutex_info all_ircon_mutexes[]=
 {
-  thr_lock_init(&lock);
-  this->socket_opened = false;
-}
+  { &ircon_key_mutex_state_dictionary, "Ircon_state_store::dictionary_mutex", 0},
+  { &ircon_key_mutex_Ircon_connection_mutex, "Ircon_connection::mutex", 0},
+  { &ircon_key_mutex_ircon_connections, "ircon_connections", PSI_FLAG_GLOBAL},
+  { &ircon_key_mutex_Ircon_event_loop_mutex, "Ircon_event_loop::mutex", 0},
+  { &ircon_key_mutex_Ircon_journal_mutex, "Ircon_journal::mutex",
+    PSI_FLAG_GLOBAL},
+  { &ircon_key_mutex_Ircon_state_file_mutex, "Ircon_state_file::mutex", 0},
+  { &ircon_key_mutex_Ircon_share_devices_mutex, "Ircon_share::devices_mutex", 0},
+  { &ircon_key_mutex_Ircon_device_mutex, "Ircon_device::mutex", 0},
+  { &ircon_key_mutex_Ircon_resolver_mutex, "Ircon_resolver::mutex",
+    PSI_FLAG_GLOBAL},
+  { &ircon_key_mutex_Ircon_scheduler_mutex, "Ircon_scheduler::mutex",
+    PSI_FLAG_GLOBAL}
+};
 
+static PSI_rwlock_key ircon_key_rwlock_Ircon_share_state_lock;
 
-static int ircon_init_func(void *p)
+static PSI_rwlock_info all_ircon_rwlocks[]=
 {
-  DBUG_ENTER("ircon_init_func");
+  { &ircon_key_rwlock_Ircon_share_state_lock, "Ircon_share::state_lock", 0}
+};
 
-  ircon_hton= (handlerton *)p;
-  ircon_hton->state=                     SHOW_OPTION_YES;
-  ircon_hton->create=                    ircon_create_handler;
-  ircon_hton->flags=                     HTON_CAN_RECREATE;
-  ircon_hton->system_database=   ircon_system_database;
-  ircon_hton->is_supported_system_table= ircon_is_supported_system_table;
+static PSI_cond_key ircon_key_cond_Ircon_connection_drained;
+static PSI_cond_key ircon_key_cond_Ircon_resolver_queued;
 
-  DBUG_RETURN(0);
+static PSI_cond_info all_ircon_conds[]=
+{
+  { &ircon_key_cond_Ircon_connection_drained, "Ircon_connection::drained", 0},
+  { &ircon_key_cond_Ircon_resolver_queued, "Ircon_resolver::queued",
+    PSI_FLAG_GLOBAL}
+};
+
+static PSI_socket_key ircon_key_socket_Ircon_connection_socket;
+
+static PSI_socket_info all_ircon_sockets[]=
+{
+  { &ircon_key_socket_Ircon_connection_socket, "Ircon_connection::socket", 0}
+};
+
+static PSI_thread_key ircon_key_thread_event_loop;
+static PSI_thread_key ircon_key_thread_resolver;
+
+static PSI_thread_info all_ircon_threads[]=
+{
+  { &ircon_key_thread_event_loop, "ircon_event_loop", 0},
+  { &ircon_key_thread_resolver, "ircon_resolver", PSI_FLAG_GLOBAL}
+};
+
+static PSI_memory_info all_ircon_memory[]=
+{
+  { &ircon_key_memory_connections, "ircon_connections", PSI_FLAG_GLOBAL},
+  { &ircon_key_memory_command_queue, "Ircon_connection::output", 0},
+  { &ircon_key_memory_devices, "Ircon_share::devices", 0},
+  { &ircon_key_memory_state, "Ircon_state_store", 0},
+  { &ircon_key_memory_field_commands, "ha_ircon::field_commands", 0},
+  { &ircon_key_memory_filter, "ha_ircon::filter", 0}
+};
+
+static PSI_stage_info *all_ircon_stages[]=
+{
+  &ircon_stage_connecting,
+  &ircon_stage_sending,
+  &ircon_stage_querying,
+  &ircon_stage_waiting_for_ack,
+  &ircon_stage_waiting_for_output,
+  &ircon_stage_waiting_for_rate_limit
+};
+
+static void init_ircon_psi_keys()
+{
+  const char* category= "ircon";
+  int count;
+
+  count= array_elements(all_ircon_mutexes);
+  mysql_mutex_register(category, all_ircon_mutexes, count);
+
+  count= array_elements(all_ircon_rwlocks);
+  mysql_rwlock_register(category, all_ircon_rwlocks, count);
+
+  count= array_elements(all_ircon_conds);
+  mysql_cond_register(category, all_ircon_conds, count);
+
+  count= array_elements(all_ircon_sockets);
+  mysql_socket_register(category, all_ircon_sockets, count);
+
+  count= array_elements(all_ircon_threads);
+  mysql_thread_register(category, all_ircon_threads, count);
+
+  count= array_elements(all_ircon_stages);
+  mysql_stage_register(category, all_ircon_stages, count);
+
+  count= array_elements(all_ircon_memory);
+  mysql_memory_register(category, all_ircon_memory, count);
 }
+#endif
+
+/** @brief
+  Puts the client thread in a stage for the lifetime of the object and
+  back in its previous stage afterwards. Does nothing in the engine's own
+  threads, which have no THD. Declared with IRCON_STAGE(), so that both
+  stage changes report the caller as their source.
+*/
+class Ircon_stage
+{
+  THD *thd;
+  PSI_stage_info old_stage;
+  const char *calling_func;
+  const char *calling_file;
+  unsigned int calling_line;
+
+public:
+  Ircon_stage(const PSI_stage_info *stage, const char *func,
+              const char *file, unsigned int line)
+    :thd(current_thd), calling_func(func), calling_file(file),
+     calling_line(line)
+  {
+    if (thd)
+      thd->enter_stage(stage, &old_stage, func, file, line);
+  }
 
+  ~Ircon_stage()
+  {
+    if (thd)
+      thd->enter_stage(&old_stage, NULL, calling_func, calling_file,
+                       calling_line);
+  }
+};
+
+#define IRCON_STAGE(stage) \
+  Ircon_stage ircon_stage_guard(stage, __func__, __FILE__, __LINE__)
 
 /**
   @brief
-  Ircon of simple lock controls. The "share" it creates is a
-  structure we will pass to each ircon handler. Do you have to have
-  one of these? Well, you have pieces that are used for locking, and
-  they are needed to function.
+  Split a device key into host and port. Accepted are "host", "host:port",
+  "[v6]", "[v6]:port" and a bare IPv6 address. A missing or zero port
+  means IRCON_DEFAULT_PORT. A key that is none of these, e.g. with a port
+  past 65535, is taken as a host name as a whole and fails to resolve.
+
+  @return
+    Length of the host, which is copied into host and terminated.
 */
+static uint ircon_parse_endpoint(const char *name, uint length, char *host,
+                                 uint *port)
+{
+  const char *end= name + length;
+  const char *host_start= name;
+  const char *host_end= end;
+  const char *port_start= NULL;
+  ulong value= 0;
 
-Ircon_share *ha_ircon::get_share()
+  if (length && *name == '[')
+  {
+    const char *bracket= (const char*) memchr(name, ']', length);
+    if (bracket && (bracket + 1 == end || bracket[1] == ':'))
+    {
+      host_start= name + 1;
+      host_end= bracket;
+      if (bracket + 1 < end)
+        port_start= bracket + 2;
+    }
+  }
+  else
+  {
+    const char *colon= (const char*) memchr(name, ':', length);
+    /* A second colon makes it an IPv6 address without port */
+    if (colon && !memchr(colon + 1, ':', end - colon - 1))
+    {
+      host_end= colon;
+      port_start= colon + 1;
+    }
+  }
+  if (port_start)
+  {
+    const char *pos;
+    for (pos= port_start; pos < end && *pos >= '0' && *pos <= '9' &&
+                          value <= 65535; pos++)
+      value= value * 10 + (*pos - '0');
+    if (pos < end || value > 65535)
+    {
+      host_start= name;
+      host_end= end;
+      value= 0;
+    }
+  }
+
+  length= (uint) MY_MIN(host_end - host_start, IRCON_ENDPOINT_LENGTH - 1);
+  memcpy(host, host_start, length);
+  host[length]= '\0';
+  *port= value ? (uint) value : IRCON_DEFAULT_PORT;
+  return length;
+}
+
+
+/**
+  @brief
+  Format the canonical "host:port" pool key of a device key; IPv6 hosts
+  are put in brackets.
+
+  @return
+    Length of the endpoint.
+*/
+uint ircon_canonical_endpoint(const char *name, uint length, char *endpoint)
 {
-  Ircon_share *tmp_share;
+  char host[IRCON_ENDPOINT_LENGTH];
+  uint port;
 
-  DBUG_ENTER("ha_ircon::get_share()");
+  ircon_parse_endpoint(name, length, host, &port);
+  return (uint) my_snprintf(endpoint, IRCON_ENDPOINT_LENGTH,
+                            strchr(host, ':') ? "[%s]:%u" : "%s:%u", host,
+                            port);
+}
 
-  lock_shared_ha_data();
-  if (!(tmp_share= static_cast<Ircon_share*>(get_ha_share_ptr())))
-  {
-    tmp_share= new Ircon_share;
-    if (!tmp_share)
-      goto err;
 
-    set_ha_share_ptr(static_cast<Handler_share*>(tmp_share));
+/**
+  @brief
+  Resolve a canonical endpoint to its first address. Numeric addresses
+  are converted without asking DNS.
+
+  @return
+    0, or the getaddrinfo() error.
+*/
+static int ircon_getaddrinfo(const char *endpoint, uint length,
+                             struct sockaddr_storage *addr,
+                             socklen_t *addr_length, bool *numeric)
+{
+  char host[IRCON_ENDPOINT_LENGTH];
+  char service[8];
+  struct addrinfo hints;
+  struct addrinfo *result;
+  uint port;
+  int error;
+
+  ircon_parse_endpoint(endpoint, length, host, &port);
+  my_snprintf(service, sizeof(service), "%u", port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family= AF_UNSPEC;
+  hints.ai_socktype= SOCK_STREAM;
+  hints.ai_flags= AI_NUMERICHOST | AI_NUMERICSERV;
+  if (!(*numeric= !getaddrinfo(host, service, &hints, &result)))
+  {
+    my_atomic_add64(&ircon_resolves, 1);
+    hints.ai_flags= AI_NUMERICSERV | AI_ADDRCONFIG;
+    if ((error= getaddrinfo(host, service, &hints, &result)))
+    {
+      my_atomic_add64(&ircon_resolve_failures, 1);
+      return error;
+    }
   }
+  memcpy(addr, result->ai_addr, result->ai_addrlen);
+  *addr_length= (socklen_t) result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+
+/** @brief
+  A device endpoint in the resolver cache.
+*/
+struct Ircon_resolved_endpoint
+{
+  char *endpoint;          ///< Canonical "host:port", the cache key
+  uint endpoint_length;
+  struct sockaddr_storage addr;
+  socklen_t addr_length;   ///< 0 until resolved once
+  int error;               ///< getaddrinfo() error of the last resolve
+  ulonglong expires_at;    ///< my_micro_time() to resolve again at, 0 never
+  bool resolving;          ///< Claimed by a thread resolving it
+  bool queued;             ///< Waiting for the resolver thread
+};
+
+/** @brief
+  Engine-wide cache of the addresses of device endpoints.
+
+  @details
+  An endpoint is resolved the first time a share adds a device for it, in
+  the client thread. Connects only read the cache, so they never wait for
+  DNS. Numeric addresses never expire. Host names expire after
+  ircon_resolve_ttl seconds, failed ones after ircon_health_check_interval;
+  the next lookup then queues the endpoint for the resolver thread and
+  goes on with the address resolved before. Entries are only freed with
+  the cache.
+*/
+class Ircon_resolver
+{
+public:
+  bool init();
+  void destroy();
+  int lookup(const char *endpoint, uint length, struct sockaddr_storage *addr,
+             socklen_t *addr_length, bool resolve);
+  void run();
+
+private:
+  mysql_mutex_t mutex;
+  mysql_cond_t queued_cond; ///< Signalled when an endpoint is queued
+  HASH endpoints;
+  MEM_ROOT arena;
+  my_thread_handle thread;
+  uint queued;             ///< Endpoints queued
+  bool stop;
+
+  Ircon_resolved_endpoint *get(const char *endpoint, uint length);
+  void resolve(Ircon_resolved_endpoint *entry);
+};
+
+static Ircon_resolver ircon_resolver;
+
+
+static uchar* ircon_resolved_endpoint_get_key(Ircon_resolved_endpoint *entry,
+                                              size_t *length,
+                                              my_bool not_used MY_ATTRIBUTE((unused)))
+{
+  *length= entry->endpoint_length;
+  return (uchar*) entry->endpoint;
+}
+
+
+static void *ircon_resolver_thread(void *arg)
+{
+  my_thread_init();
+  ((Ircon_resolver*) arg)->run();
+  my_thread_end();
+  return NULL;
+}
+
+
+/**
+  @brief
+  Set up the cache and start the resolver thread.
+
+  @return
+    false on success, true on error.
+*/
+bool Ircon_resolver::init()
+{
+  queued= 0;
+  stop= false;
+  mysql_mutex_init(ircon_key_mutex_Ircon_resolver_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+  mysql_cond_init(ircon_key_cond_Ircon_resolver_queued, &queued_cond);
+  init_alloc_root(ircon_key_memory_connections, &arena, 4096, 0);
+  if (my_hash_init(&endpoints, &my_charset_bin, 32, 0, 0,
+                   (my_hash_get_key) ircon_resolved_endpoint_get_key, 0, 0,
+                   ircon_key_memory_connections))
+    goto err;
+  if (mysql_thread_create(ircon_key_thread_resolver, &thread, NULL,
+                          ircon_resolver_thread, this))
+  {
+    my_hash_free(&endpoints);
+    goto err;
+  }
+  return false;
+
 err:
-  unlock_shared_ha_data();
-  DBUG_RETURN(tmp_share);
+  free_root(&arena, MYF(0));
+  mysql_cond_destroy(&queued_cond);
+  mysql_mutex_destroy(&mutex);
+  return true;
+}
+
+
+/**
+  @brief
+  Stop the resolver thread and free the cache, once no connect can look
+  it up any more.
+*/
+void Ircon_resolver::destroy()
+{
+  mysql_mutex_lock(&mutex);
+  stop= true;
+  mysql_cond_signal(&queued_cond);
+  mysql_mutex_unlock(&mutex);
+  my_thread_join(&thread, NULL);
+  my_hash_free(&endpoints);
+  free_root(&arena, MYF(0));
+  mysql_cond_destroy(&queued_cond);
+  mysql_mutex_destroy(&mutex);
+}
+
+
+/**
+  @brief
+  Find the cache entry of an endpoint, adding an unresolved one if there
+  is none.
+
+  @return
+    The entry, or NULL when out of memory.
+*/
+Ircon_resolved_endpoint *Ircon_resolver::get(const char *endpoint,
+                                             uint length)
+{
+  Ircon_resolved_endpoint *entry;
+
+  mysql_mutex_assert_owner(&mutex);
+  if ((entry= (Ircon_resolved_endpoint*) my_hash_search(&endpoints,
+                                                        (const uchar*) endpoint,
+                                                        length)))
+    return entry;
+  if (!(entry= (Ircon_resolved_endpoint*) alloc_root(&arena, sizeof(*entry) +
+                                                              length + 1)))
+    return NULL;
+  memset(entry, 0, sizeof(*entry));
+  entry->endpoint= (char*) (entry + 1);
+  entry->endpoint_length= length;
+  memcpy(entry->endpoint, endpoint, length);
+  entry->endpoint[length]= '\0';
+  entry->error= EAI_AGAIN;
+  /* Not resolved yet: expired */
+  entry->expires_at= 1;
+  if (my_hash_insert(&endpoints, (uchar*) entry))
+    return NULL;
+  return entry;
+}
+
+
+/**
+  @brief
+  Resolve an endpoint claimed with resolving, without the mutex. A failed
+  resolve keeps the address resolved before, if any.
+*/
+void Ircon_resolver::resolve(Ircon_resolved_endpoint *entry)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_length;
+  bool numeric;
+  int error;
+
+  error= ircon_getaddrinfo(entry->endpoint, entry->endpoint_length, &addr,
+                           &addr_length, &numeric);
+  mysql_mutex_lock(&mutex);
+  if (!error)
+  {
+    entry->addr= addr;
+    entry->addr_length= addr_length;
+  }
+  entry->error= error;
+  if (error)
+    entry->expires_at= my_micro_time() +
+                       (ulonglong) srv_health_check_interval * 1000;
+  else if (numeric || !srv_resolve_ttl)
+    entry->expires_at= 0;
+  else
+    entry->expires_at= my_micro_time() +
+                       (ulonglong) srv_resolve_ttl * 1000000;
+  entry->resolving= false;
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Get the address of a canonical endpoint from the cache.
+
+  @param resolve  Resolve an endpoint that never was in this thread,
+                  instead of leaving it to the resolver thread.
+
+  @return
+    0, or the getaddrinfo() error if the endpoint has no address yet.
+*/
+int Ircon_resolver::lookup(const char *endpoint, uint length,
+                           struct sockaddr_storage *addr,
+                           socklen_t *addr_length, bool resolve)
+{
+  Ircon_resolved_endpoint *entry;
+  int error;
+
+  mysql_mutex_lock(&mutex);
+  if (!(entry= get(endpoint, length)))
+  {
+    mysql_mutex_unlock(&mutex);
+    return EAI_MEMORY;
+  }
+  if (resolve && !entry->addr_length && !entry->resolving)
+  {
+    entry->resolving= true;
+    mysql_mutex_unlock(&mutex);
+    this->resolve(entry);
+    mysql_mutex_lock(&mutex);
+  }
+  else if (entry->expires_at && my_micro_time() >= entry->expires_at &&
+           !entry->resolving)
+  {
+    entry->resolving= true;
+    entry->queued= true;
+    queued++;
+    mysql_cond_signal(&queued_cond);
+  }
+  if (!(error= entry->addr_length ? 0 : entry->error))
+  {
+    *addr= entry->addr;
+    *addr_length= entry->addr_length;
+  }
+  mysql_mutex_unlock(&mutex);
+  return error;
+}
+
+
+/**
+  @brief
+  Body of the resolver thread: resolve the queued endpoints one at a
+  time until destroy().
+*/
+void Ircon_resolver::run()
+{
+  mysql_mutex_lock(&mutex);
+  while (!stop)
+  {
+    if (!queued)
+    {
+      mysql_cond_wait(&queued_cond, &mutex);
+      continue;
+    }
+    /*
+      Entries are never deleted, but inserts may move them while the mutex
+      is released; a queued entry the scan misses is found by the next.
+    */
+    for (ulong i= 0; i < endpoints.records && !stop; i++)
+    {
+      Ircon_resolved_endpoint *entry=
+        (Ircon_resolved_endpoint*) my_hash_element(&endpoints, i);
+      if (!entry->queued)
+        continue;
+      entry->queued= false;
+      queued--;
+      mysql_mutex_unlock(&mutex);
+      resolve(entry);
+      mysql_mutex_lock(&mutex);
+    }
+  }
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/** @brief
+  An engine thread multiplexing the sockets of the connections assigned
+  to it with epoll. There are ircon_event_threads of them.
+*/
+class Ircon_event_loop
+{
+public:
+  int epoll_fd;
+  int wake_fd;             ///< eventfd to interrupt epoll_wait()
+  my_thread_handle thread;
+  mysql_mutex_t mutex;     ///< Protects connections and retired
+  Ircon_connection *connections; ///< Pooled connections assigned to the loop
+  Ircon_connection *retired; ///< Connections to free once no event can refer to them
+
+  bool init();
+  void destroy();
+  void wake();
+  void attach(Ircon_connection *connection);
+  void retire(Ircon_connection *connection);
+  void run();
+};
+
+static Ircon_event_loop *ircon_assign_event_loop();
+
+
+static char *srv_journal_file= NULL;
+
+static MYSQL_SYSVAR_STR(
+  journal_file,
+  srv_journal_file,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "File, relative to the data directory, journaling the commands handed to "
+  "the event loops until they are written. Commands still in it at startup "
+  "are sent again. Empty disables the journal.",
+  NULL,
+  NULL,
+  NULL);
+
+static ulong srv_journal_size= 16 * 1024 * 1024;
+
+static MYSQL_SYSVAR_ULONG(
+  journal_size,
+  srv_journal_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Bytes of the journal file. Commands that do not fit are sent without "
+  "being journaled.",
+  NULL,
+  NULL,
+  16 * 1024 * 1024,
+  64 * 1024,
+  1024 * 1024 * 1024,
+  4096);
+
+static ulong srv_journal_sync_interval= 100;
+
+static MYSQL_SYSVAR_ULONG(
+  journal_sync_interval,
+  srv_journal_sync_interval,
+  PLUGIN_VAR_RQCMDARG,
+  "Milliseconds between syncs of the journal to disk. 0 syncs only after "
+  "ircon_journal_sync_commands commands.",
+  NULL,
+  NULL,
+  100,
+  0,
+  60000,
+  0);
+
+static ulong srv_journal_sync_commands= 0;
+
+static MYSQL_SYSVAR_ULONG(
+  journal_sync_commands,
+  srv_journal_sync_commands,
+  PLUGIN_VAR_RQCMDARG,
+  "Commands journaled that make the next of them sync the journal to "
+  "disk. 0 leaves syncing to ircon_journal_sync_interval.",
+  NULL,
+  NULL,
+  0,
+  0,
+  1024 * 1024,
+  0);
+
+/* Commands journaled, replayed at startup, and not journaled for space */
+static int64 ircon_journal_records= 0;
+static int64 ircon_journal_replayed= 0;
+static int64 ircon_journal_overflows= 0;
+static int64 ircon_journal_syncs= 0;
+
+#define IRCON_JOURNAL_MAGIC "IRCONJ03"
+#define IRCON_JOURNAL_MAGIC_LENGTH 8
+/* Journals before the ring, replayed once and then rewritten */
+#define IRCON_JOURNAL_LINEAR_MAGIC "IRCONJ02"
+/* The magic and the offset of the oldest record not done */
+#define IRCON_JOURNAL_HEADER_LENGTH 16
+/* Length of the record that continues the ring at its beginning */
+#define IRCON_JOURNAL_WRAP 0xffffffffU
+
+/** @brief
+  A journal record, followed by the canonical endpoint of the device and
+  the command, and padded to 8 bytes. A zero length ends the journal.
+*/
+struct Ircon_journal_record
+{
+  uint32 length;           ///< Of the command
+  uint32 done;             ///< Set once the command was written or dropped
+  uint32 endpoint_length;
+};
+
+/** @brief
+  Write-ahead journal of the commands queued to the event loops, in a
+  memory mapped file.
+
+  @details
+  A command is journaled when it is queued and marked done when its
+  connection's output has been written or dropped. The journal is a
+  ring: records are appended at end, wrapping round to the beginning of
+  the file, and start, kept in the file header, moves past the oldest
+  records as they are done. Under steady load the space behind start is
+  reused, and once no record is left to be done the journal starts over
+  at the beginning. It only fills up when its oldest command is held up
+  while a journal's worth of newer ones is queued; then it takes no more
+  records until that command is written or dropped, and says so in the
+  error log. The mapping survives a crash of mysqld as is; syncs, grouped
+  by ircon_journal_sync_interval and ircon_journal_sync_commands, make it
+  survive one of the host. Commands are replayed at least once: output
+  written just before a crash may be sent again.
+
+  Only commands handed to the event loops are journaled. A synchronous
+  command the client thread sends itself is written before its statement
+  returns, or the statement fails, so there is nothing left to replay
+  for it that the client was told had been sent.
+*/
+class Ircon_journal
+{
+public:
+  mysql_mutex_t mutex;     ///< Protects everything but map and size
+  File file;
+  /*
+    NULL while the journal is disabled. Set before the event loops start
+    and cleared after they stopped, so it is read without the mutex.
+  */
+  uchar *map;
+  size_t size;
+  size_t start;            ///< Offset of the oldest record not done
+  size_t end;              ///< Offset of the terminating record
+  ulong outstanding;       ///< Records not done
+  ulong unsynced;          ///< Records appended since the last sync
+  ulonglong synced_at;     ///< my_micro_time() of the last sync
+  bool full;               ///< The last append did not fit
+
+  bool open(const char *path, size_t size_arg);
+  void close();
+  size_t append(const char *endpoint, uint endpoint_length, const char *line,
+                size_t length);
+  void complete(const size_t *offsets, uint count);
+  void sync();
+  void tick(ulonglong now);
+  void replay();
+
+private:
+  Ircon_journal_record *record(size_t offset)
+  { return (Ircon_journal_record*) (map + offset); }
+  static size_t record_size(size_t length)
+  { return MY_ALIGN(sizeof(Ircon_journal_record) + length, 8); }
+  static size_t record_size(const Ircon_journal_record *rec)
+  { return record_size((size_t) rec->endpoint_length + rec->length); }
+  void store_start()
+  { *(ulonglong*) (map + IRCON_JOURNAL_MAGIC_LENGTH)= start; }
+  void reset();
+};
+
+static Ircon_journal ircon_journal;
+
+
+/**
+  @brief
+  Map the journal file, creating it if needed. An existing journal keeps
+  its records for replay().
+
+  @return
+    false on success, true on error.
+*/
+bool Ircon_journal::open(const char *path, size_t size_arg)
+{
+  struct stat stat_info;
+  DBUG_ENTER("Ircon_journal::open");
+
+  mysql_mutex_init(ircon_key_mutex_Ircon_journal_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+  outstanding= unsynced= 0;
+  full= false;
+  synced_at= my_micro_time();
+  if ((file= my_open(path, O_RDWR | O_CREAT, MYF(MY_WME))) < 0)
+    goto err;
+  if (fstat(file, &stat_info))
+    goto err_close;
+  /* A journal grown by an earlier setting is kept whole */
+  size= MY_MAX(size_arg, (size_t) stat_info.st_size);
+  if ((size_t) stat_info.st_size < size &&
+      my_chsize(file, size, 0, MYF(MY_WME)))
+    goto err_close;
+  if ((map= (uchar*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          file, 0)) == MAP_FAILED)
+    goto err_close;
+  if (!memcmp(map, IRCON_JOURNAL_MAGIC, IRCON_JOURNAL_MAGIC_LENGTH))
+  {
+    start= (size_t) *(ulonglong*) (map + IRCON_JOURNAL_MAGIC_LENGTH);
+    if (start < IRCON_JOURNAL_HEADER_LENGTH ||
+        start + sizeof(Ircon_journal_record) > size)
+      reset();
+  }
+  else if (!memcmp(map, IRCON_JOURNAL_LINEAR_MAGIC,
+                   IRCON_JOURNAL_MAGIC_LENGTH))
+    start= IRCON_JOURNAL_MAGIC_LENGTH;
+  else
+    reset();
+  end= start;
+  DBUG_RETURN(false);
+
+err_close:
+  my_close(file, MYF(0));
+err:
+  map= NULL;
+  mysql_mutex_destroy(&mutex);
+  DBUG_RETURN(true);
+}
+
+
+/**
+  @brief
+  Sync and unmap the journal. Records not done stay for the next startup.
+*/
+void Ircon_journal::close()
+{
+  uchar *old_map= map;
+
+  if (!old_map)
+    return;
+  map= NULL;
+  msync(old_map, size, MS_SYNC);
+  munmap(old_map, size);
+  my_close(file, MYF(0));
+  mysql_mutex_destroy(&mutex);
+}
+
+
+/**
+  @brief
+  Start over with an empty journal. Must be called with mutex held, or
+  before the journal is in use.
+*/
+void Ircon_journal::reset()
+{
+  start= end= IRCON_JOURNAL_HEADER_LENGTH;
+  record(end)->length= 0;
+  store_start();
+  memcpy(map, IRCON_JOURNAL_MAGIC, IRCON_JOURNAL_MAGIC_LENGTH);
+}
+
+
+/**
+  @brief
+  Journal a command to a device.
+
+  @details
+  The record goes at end, or at the beginning of the file when it does
+  not fit before the end of it and the oldest record is far enough from
+  the beginning. A record and its terminator never reach start.
+
+  @return
+    Offset of the record to complete(), or 0 if the journal is disabled or
+    full.
+*/
+size_t Ircon_journal::append(const char *endpoint, uint endpoint_length,
+                             const char *line, size_t length)
+{
+  size_t needed= record_size(endpoint_length + length) +
+                 sizeof(Ircon_journal_record);
+  Ircon_journal_record *rec;
+  size_t offset;
+  bool sync_now;
+  bool warn;
+
+  if (!map)
+    return 0;
+  mysql_mutex_lock(&mutex);
+  if (end < start ? end + needed <= start : end + needed <= size)
+    offset= end;
+  else if (end >= start && IRCON_JOURNAL_HEADER_LENGTH + needed <= start)
+    offset= IRCON_JOURNAL_HEADER_LENGTH;
+  else
+  {
+    warn= !full;
+    full= true;
+    mysql_mutex_unlock(&mutex);
+    my_atomic_add64(&ircon_journal_overflows, 1);
+    if (warn)
+      sql_print_warning("IRCON: journal file '%s' is full, commands are not "
+                        "journaled until the oldest one is sent or dropped",
+                        srv_journal_file);
+    return 0;
+  }
+  full= false;
+  rec= record(offset);
+  rec->done= 0;
+  rec->endpoint_length= endpoint_length;
+  memcpy(rec + 1, endpoint, endpoint_length);
+  memcpy((uchar*) (rec + 1) + endpoint_length, line, length);
+  /* Terminate the journal before the record becomes part of it */
+  record(offset + needed - sizeof(Ircon_journal_record))->length= 0;
+  rec->length= (uint32) length;
+  /* A record at the beginning is reached through the old end */
+  if (offset != end)
+    record(end)->length= IRCON_JOURNAL_WRAP;
+  end= offset + needed - sizeof(Ircon_journal_record);
+  outstanding++;
+  unsynced++;
+  sync_now= srv_journal_sync_commands &&
+            unsynced >= srv_journal_sync_commands;
+  mysql_mutex_unlock(&mutex);
+  my_atomic_add64(&ircon_journal_records, 1);
+  if (sync_now)
+    sync();
+  return offset;
+}
+
+
+/**
+  @brief
+  Mark records done and move start past the oldest ones that are. The
+  journal starts over when none is left.
+*/
+void Ircon_journal::complete(const size_t *offsets, uint count)
+{
+  if (!map)
+    return;
+  mysql_mutex_lock(&mutex);
+  for (uint i= 0; i < count; i++)
+    record(offsets[i])->done= 1;
+  if (!(outstanding-= count))
+    reset();
+  else
+  {
+    size_t old_start= start;
+    while (start != end)
+    {
+      if (record(start)->length == IRCON_JOURNAL_WRAP)
+        start= IRCON_JOURNAL_HEADER_LENGTH;
+      else if (record(start)->done)
+        start+= record_size(record(start));
+      else
+        break;
+    }
+    if (start != old_start)
+      store_start();
+  }
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Write the journal to disk, covering every record appended so far. The
+  mutex is not held while syncing, appends go on meanwhile.
+*/
+void Ircon_journal::sync()
+{
+  size_t length;
+
+  if (!map)
+    return;
+  mysql_mutex_lock(&mutex);
+  if (!unsynced)
+  {
+    mysql_mutex_unlock(&mutex);
+    return;
+  }
+  /* Records may be on both sides of start once the ring wrapped */
+  length= end < start ? size : end + sizeof(Ircon_journal_record);
+  unsynced= 0;
+  synced_at= my_micro_time();
+  mysql_mutex_unlock(&mutex);
+  msync(map, length, MS_SYNC);
+  my_atomic_add64(&ircon_journal_syncs, 1);
+}
+
+
+/**
+  @brief
+  Sync if ircon_journal_sync_interval has passed. Called by the event
+  loops every tick.
+*/
+void Ircon_journal::tick(ulonglong now)
+{
+  if (map && srv_journal_sync_interval && unsynced &&
+      now - synced_at >= (ulonglong) srv_journal_sync_interval * 1000)
+    sync();
+}
+
+
+/**
+  @brief
+  Queue the commands a previous run left not done to their devices again,
+  once the event loops run. The records from start on that are not done
+  are copied out first, in the order they were journaled, so that the
+  journal can start over and journal them anew.
+*/
+void Ircon_journal::replay()
+{
+  uchar *copy= NULL;
+  size_t length= 0;
+  DBUG_ENTER("Ircon_journal::replay");
+
+  /* Measure the records, then copy them */
+  for (uint pass= 0; pass < 2; pass++)
+  {
+    size_t offset= start;
+    size_t walked= 0;
+    size_t copied= 0;
+
+    while (walked < size && offset + sizeof(Ircon_journal_record) <= size)
+    {
+      Ircon_journal_record *rec= record(offset);
+      size_t rec_size;
+
+      if (rec->length == IRCON_JOURNAL_WRAP)
+      {
+        walked+= size - offset;
+        offset= IRCON_JOURNAL_HEADER_LENGTH;
+        continue;
+      }
+      if (!rec->length || (rec_size= record_size(rec)) > size - offset)
+        break;
+      if (!rec->done)
+      {
+        if (copy)
+          memcpy(copy + copied, rec, rec_size);
+        copied+= rec_size;
+      }
+      walked+= rec_size;
+      offset+= rec_size;
+    }
+    if (copy)
+      break;
+    if (!(length= copied) ||
+        !(copy= (uchar*) my_malloc(ircon_key_memory_command_queue, length,
+                                   MYF(MY_WME))))
+    {
+      reset();
+      DBUG_VOID_RETURN;
+    }
+  }
+  reset();
+
+  for (size_t offset= 0; offset + sizeof(Ircon_journal_record) <= length;)
+  {
+    Ircon_journal_record *rec= (Ircon_journal_record*) (copy + offset);
+
+    const char *endpoint= (const char*) (rec + 1);
+    Ircon_connection *connection;
+
+    offset+= record_size(rec);
+    if (rec->endpoint_length >= IRCON_ENDPOINT_LENGTH ||
+        !(connection= ircon_acquire_connection(endpoint,
+                                               rec->endpoint_length)))
+      continue;
+    if (!connection->queue_line(endpoint + rec->endpoint_length, rec->length,
+                                1, NULL, NULL))
+      my_atomic_add64(&ircon_journal_replayed, 1);
+    ircon_release_connection(connection);
+  }
+  my_free(copy);
+  if (ircon_journal_replayed)
+    sql_print_information("IRCON: replayed %lld journaled commands",
+                          (longlong) ircon_journal_replayed);
+  DBUG_VOID_RETURN;
+}
+
+
+Ircon_connection::Ircon_connection(const char *endpoint_arg, uint length)
+  :endpoint_length(length), addr_length(0), socket(MYSQL_INVALID_SOCKET),
+   state(IRCON_CONNECTION_CLOSED),
+   ref_count(0), idle_since(0), queued(0), loop(NULL), loop_next(NULL),
+   loop_prev(NULL), next_retired(NULL),
+   output(NULL), output_size(0), output_start(0), output_end(0),
+   blocking_flags(0), connect_deadline(0), registered(false), events(0),
+   output_seq(0), written_seq(0), dropped_seq(0), journal_records(NULL),
+   journal_record_count(0), journal_record_size(0), breaker(IRCON_BREAKER_CLOSED), consecutive_failures(0), probe_at(0),
+   next_seq(1), acked_seq(0), lost_seq(0), ack_length(0), querying(false),
+   query_result(0), query_response_length(0),
+   commands_sent(0), bytes_sent(0), connect_failures(0),
+   ever_connected(false), last_sent_at(0), send_rate(0.0), send_rate_at(0),
+   last_command_length(0), rate_tat(0), deferred(0), deferred_rate(0),
+   deferred_line(NULL), deferred_length(0), deferred_size(0),
+   deferred_ticket(0), released_ticket(0), released_line(0)
+{
+  memset(latency, 0, sizeof(latency));
+  memcpy(endpoint, endpoint_arg, length);
+  endpoint[length]= '\0';
+  mysql_mutex_init(ircon_key_mutex_Ircon_connection_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+  mysql_cond_init(ircon_key_cond_Ircon_connection_drained, &drained);
+}
+
+
+Ircon_connection::~Ircon_connection()
+{
+  disconnect();
+  if (deferred)
+  {
+    my_atomic_add64(&ircon_deferred_dropped, 1);
+    my_atomic_add64(&ircon_output_depth, -1);
+  }
+  my_free(deferred_line);
+  my_free(output);
+  my_free(journal_records);
+  mysql_cond_destroy(&drained);
+  mysql_mutex_destroy(&mutex);
+}
+
+
+/**
+  @brief
+  Start a non-blocking connect to the device. Must be called with mutex
+  held.
+
+  @details
+  The connection is either connected on return or connecting, in which
+  case the event loop or connect_device() completes it and it fails
+  ircon_connect_timeout milliseconds from now.
+
+  @return
+    0 on success, HA_ERR_NO_CONNECTION otherwise.
+*/
+int Ircon_connection::start_connect()
+{
+  DBUG_ENTER("Ircon_connection::start_connect");
+  mysql_mutex_assert_owner(&mutex);
+
+  my_atomic_add64(&ircon_connect_attempts, 1);
+  if (ever_connected)
+    my_atomic_add64(&ircon_reconnects, 1);
+  /* A name not resolved yet fails like a refused connect */
+  if (ircon_resolver.lookup(endpoint, endpoint_length, &addr, &addr_length,
+                            false))
+    DBUG_RETURN(connect_failed());
+  socket= mysql_socket_socket(ircon_key_socket_Ircon_connection_socket,
+                              addr.ss_family, SOCK_STREAM, 0);
+  if (mysql_socket_getfd(socket) == INVALID_SOCKET)
+    DBUG_RETURN(connect_failed());
+  if ((blocking_flags= fcntl(mysql_socket_getfd(socket), F_GETFL, 0)) < 0 ||
+      fcntl(mysql_socket_getfd(socket), F_SETFL,
+            blocking_flags | O_NONBLOCK) < 0)
+    DBUG_RETURN(connect_failed());
+
+  if (mysql_socket_connect(socket, (struct sockaddr *) &addr,
+                           addr_length) == 0)
+    DBUG_RETURN(finish_connect());
+  if (errno != EINPROGRESS)
+    DBUG_RETURN(connect_failed());
+  state= IRCON_CONNECTION_CONNECTING;
+  connect_deadline= my_micro_time() + (ulonglong) srv_connect_timeout * 1000;
+  update_events();
+  DBUG_RETURN(0);
 }
 
 
-static handler* ircon_create_handler(handlerton *hton,
-                                       TABLE_SHARE *table, 
-                                       MEM_ROOT *mem_root)
+/**
+  @brief
+  Complete a connect once the socket is writable. The socket is blocking
+  again afterwards. TCP keepalive is enabled so that a connection idling
+  in the pool notices a dead peer within a few ircon_health_check_interval
+  periods; the event loop then sees the hangup. A successful connect
+  closes the circuit breaker.
+*/
+int Ircon_connection::finish_connect()
+{
+  int error= 0;
+  int keepalive= 1;
+  socklen_t error_length= sizeof(error);
+
+  if (mysql_socket_getsockopt(socket, SOL_SOCKET, SO_ERROR, &error,
+                              &error_length) < 0 ||
+      error != 0 || fcntl(mysql_socket_getfd(socket), F_SETFL,
+                          blocking_flags) < 0)
+    return connect_failed();
+  mysql_socket_setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &keepalive,
+                          sizeof(keepalive));
+#ifdef TCP_KEEPIDLE
+  {
+    int interval= (int) MY_MAX(srv_health_check_interval / 1000, 1);
+    int count= 3;
+    mysql_socket_setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &interval,
+                            sizeof(interval));
+    mysql_socket_setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                            sizeof(interval));
+    mysql_socket_setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count,
+                            sizeof(count));
+  }
+#endif
+  state= IRCON_CONNECTION_CONNECTED;
+  ever_connected= true;
+  consecutive_failures= 0;
+  if (breaker != IRCON_BREAKER_CLOSED)
+  {
+    breaker= IRCON_BREAKER_CLOSED;
+    my_atomic_add64(&ircon_breakers_open, -1);
+  }
+  update_events();
+  return 0;
+}
+
+
+/**
+  @brief
+  Count a failed connect, opening the circuit breaker after
+  ircon_breaker_threshold of them in a row. A failed health check leaves
+  it open until the next one.
+*/
+int Ircon_connection::connect_failed()
+{
+  disconnect();
+  state= IRCON_CONNECTION_FAILED;
+  connect_failures++;
+  my_atomic_add64(&ircon_connect_failures, 1);
+  consecutive_failures++;
+  if (breaker == IRCON_BREAKER_CLOSED && srv_breaker_threshold &&
+      consecutive_failures >= srv_breaker_threshold)
+  {
+    my_atomic_add64(&ircon_breakers_open, 1);
+    my_atomic_add64(&ircon_breaker_trips, 1);
+    breaker= IRCON_BREAKER_OPEN;
+  }
+  if (breaker != IRCON_BREAKER_CLOSED)
+  {
+    breaker= IRCON_BREAKER_OPEN;
+    probe_at= my_micro_time() + (ulonglong) srv_health_check_interval * 1000;
+  }
+  return HA_ERR_NO_CONNECTION;
+}
+
+
+/**
+  @brief
+  Connect to the device without blocking for longer than
+  ircon_connect_timeout milliseconds. A connect the event loop started is
+  taken over and waited for. Must be called with mutex held.
+
+  @return
+    0 on success, IRCON_ERROR_CIRCUIT_OPEN without trying while the
+    circuit breaker is open, HA_ERR_NO_CONNECTION otherwise.
+*/
+int Ircon_connection::connect_device()
+{
+  struct pollfd pfd;
+  ulonglong now;
+  int rc;
+  DBUG_ENTER("Ircon_connection::connect_device");
+  mysql_mutex_assert_owner(&mutex);
+
+  if (state == IRCON_CONNECTION_CONNECTED)
+    DBUG_RETURN(0);
+  if (breaker_open())
+  {
+    my_atomic_add64(&ircon_breaker_rejects, 1);
+    DBUG_RETURN(IRCON_ERROR_CIRCUIT_OPEN);
+  }
+  IRCON_STAGE(&ircon_stage_connecting);
+  if (state != IRCON_CONNECTION_CONNECTING &&
+      ((rc= start_connect()) || state == IRCON_CONNECTION_CONNECTED))
+    DBUG_RETURN(rc);
+
+  pfd.fd= mysql_socket_getfd(socket);
+  pfd.events= POLLOUT;
+  do
+  {
+    if ((now= my_micro_time()) >= connect_deadline)
+      DBUG_RETURN(connect_failed());
+    rc= poll(&pfd, 1, (int) ((connect_deadline - now + 999) / 1000));
+  } while (rc < 0 && errno == EINTR);
+  if (rc <= 0)
+    DBUG_RETURN(connect_failed());
+  DBUG_RETURN(finish_connect());
+}
+
+
+/**
+  @brief
+  Drop the connection; the next command reconnects.
+*/
+void Ircon_connection::disconnect()
+{
+  lose_unacked();
+  if (querying && query_result < 0)
+  {
+    query_result= HA_ERR_NO_CONNECTION;
+    mysql_cond_broadcast(&drained);
+  }
+  if (registered)
+  {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, mysql_socket_getfd(socket),
+              NULL);
+    registered= false;
+    events= 0;
+  }
+  if (mysql_socket_getfd(socket) != INVALID_SOCKET)
+  {
+    mysql_socket_shutdown(socket, SHUT_RDWR);
+    mysql_socket_close(socket);
+  }
+  socket= MYSQL_INVALID_SOCKET;
+  state= IRCON_CONNECTION_CLOSED;
+}
+
+
+static uchar* ircon_connection_get_key(Ircon_connection *connection,
+                                       size_t *length,
+                                       my_bool not_used MY_ATTRIBUTE((unused)))
+{
+  *length= connection->endpoint_length;
+  return (uchar*) connection->endpoint;
+}
+
+
+static void ircon_connection_free(Ircon_connection *connection)
+{
+  /* Events the loop already fetched may still point at the connection */
+  if (connection->loop)
+    connection->loop->retire(connection);
+  else
+    delete connection;
+}
+
+
+/**
+  @brief
+  Whether a pooled connection has been unused for longer than
+  ircon_pool_max_idle, with nothing left to write. The event loop asks
+  without ircon_connections_mutex to pick the connections to expire, and
+  ircon_expire_idle_connections() asks again with it held.
+*/
+static bool ircon_connection_idle(Ircon_connection *connection,
+                                  ulonglong now)
+{
+  return connection->ref_count == 0 &&
+         my_atomic_load32(&connection->queued) == 0 &&
+         !my_atomic_load32(&connection->deferred) &&
+         now - connection->idle_since >=
+         (ulonglong) srv_pool_max_idle * 1000000ULL;
+}
+
+
+/**
+  @brief
+  Close the idle connections an event loop found among its own, see
+  ircon_connection_idle(). Only the loop a connection is assigned to
+  expires it, so the connections are still there; one acquired again in
+  the meantime is kept.
+*/
+static void ircon_expire_idle_connections(Ircon_connection **connections,
+                                          uint count, ulonglong now)
+{
+  mysql_mutex_lock(&ircon_connections_mutex);
+  for (uint i= 0; i < count; i++)
+    if (ircon_connection_idle(connections[i], now))
+      my_hash_delete(&ircon_connections, (uchar*) connections[i]);
+  mysql_mutex_unlock(&ircon_connections_mutex);
+}
+
+
+/**
+  @brief
+  Get the pooled connection to a canonical endpoint, see
+  ircon_canonical_endpoint(), creating it if needed. The socket itself is
+  only opened by the first command.
+
+  @return
+    The connection, or NULL when out of memory.
+*/
+Ircon_connection *ircon_acquire_connection(const char *endpoint, uint length)
+{
+  Ircon_connection *connection;
+  DBUG_ENTER("ircon_acquire_connection");
+
+  mysql_mutex_lock(&ircon_connections_mutex);
+  if (!(connection= (Ircon_connection*) my_hash_search(&ircon_connections,
+                                                       (uchar*) endpoint,
+                                                       length)))
+  {
+    connection= new Ircon_connection(endpoint, length);
+    if (!connection)
+      goto end;
+    connection->loop= ircon_assign_event_loop();
+    if (my_hash_insert(&ircon_connections, (uchar*) connection))
+    {
+      delete connection;
+      connection= NULL;
+      goto end;
+    }
+    connection->loop->attach(connection);
+  }
+  connection->ref_count++;
+end:
+  mysql_mutex_unlock(&ircon_connections_mutex);
+  DBUG_RETURN(connection);
+}
+
+
+/**
+  @brief
+  Take another reference to a pooled connection one is held to already.
+*/
+void ircon_retain_connection(Ircon_connection *connection)
+{
+  mysql_mutex_lock(&ircon_connections_mutex);
+  connection->ref_count++;
+  mysql_mutex_unlock(&ircon_connections_mutex);
+}
+
+
+/**
+  @brief
+  Drop a reference to a pooled connection. The connection stays
+  open for reuse until it has been idle for ircon_pool_max_idle seconds;
+  its event loop closes it then.
+*/
+void ircon_release_connection(Ircon_connection *connection)
+{
+  DBUG_ENTER("ircon_release_connection");
+  mysql_mutex_lock(&ircon_connections_mutex);
+  if (--connection->ref_count == 0)
+    connection->idle_since= my_micro_time();
+  mysql_mutex_unlock(&ircon_connections_mutex);
+  DBUG_VOID_RETURN;
+}
+
+
+Ircon_state_store::Ircon_state_store()
+  :mode(NULL), temperature(NULL), power(NULL), angle(NULL), version(NULL),
+   capacity(0),
+   value_count(1)
+{
+  init_alloc_root(ircon_key_memory_state, &arena, 1024, 0);
+  mysql_mutex_init(ircon_key_mutex_state_dictionary, &dictionary_mutex,
+                   MY_MUTEX_INIT_FAST);
+  values[0]= IRCON_COMMAND_UNKNOWN;
+  value_lengths[0]= sizeof(IRCON_COMMAND_UNKNOWN) - 1;
+}
+
+
+Ircon_state_store::~Ircon_state_store()
+{
+  mysql_mutex_destroy(&dictionary_mutex);
+  free_root(&arena, MYF(0));
+}
+
+
+/**
+  @brief
+  Make room for the given number of slots. New slots have unknown state.
+
+  @details
+  The columns are moved to a new block of twice the size; the old block
+  stays in the arena until the share goes away, which at most doubles the
+  memory the store holds.
+
+  @return
+    false on success, true when out of memory.
+*/
+bool Ircon_state_store::reserve(uint slots)
+{
+  uint size;
+  uchar *block;
+  int32 *tmp_version;
+  int16 *tmp_temperature;
+
+  if (slots <= capacity)
+    return false;
+  size= capacity ? capacity * 2 : 8;
+  if (size < slots)
+    size= slots;
+
+  /* The wider columns go first to keep them aligned */
+  if (!(block= (uchar*) alloc_root(&arena, size * (sizeof(*version) +
+                                                   sizeof(*temperature) +
+                                                   sizeof(*mode) +
+                                                   sizeof(*power) +
+                                                   sizeof(*angle)))))
+    return true;
+  tmp_version= (int32*) block;
+  block+= size * sizeof(*version);
+  tmp_temperature= (int16*) block;
+  block+= size * sizeof(*temperature);
+  if (capacity)
+  {
+    memcpy(tmp_version, version, capacity * sizeof(*version));
+    memcpy(tmp_temperature, temperature, capacity * sizeof(*temperature));
+    memcpy(block, mode, capacity * sizeof(*mode));
+    memcpy(block + size, power, capacity * sizeof(*power));
+    memcpy(block + 2 * size, angle, capacity * sizeof(*angle));
+  }
+  version= tmp_version;
+  temperature= tmp_temperature;
+  mode= block;
+  power= (int8*) (block + size);
+  angle= block + 2 * size;
+
+  for (uint slot= capacity; slot < size; slot++)
+  {
+    version[slot]= 0;
+    reset(slot);
+  }
+  capacity= size;
+  return false;
+}
+
+
+void Ircon_state_store::reset(uint slot)
+{
+  mode[slot]= 0;
+  temperature[slot]= TEMPERATURE_UNKNOWN;
+  power[slot]= POWER_UNKNOWN;
+  angle[slot]= 0;
+  my_atomic_add32(&version[slot], 1);
+}
+
+
+/**
+  @brief
+  Get the dictionary code of a mode or angle value, adding it if it is
+  new. The dictionary is shared by both commands and never shrinks while
+  the share is open: once it holds 255 values, a new one is rejected
+  until FLUSH TABLES reloads the table with the values still in use.
+
+  @details
+  Scans read the dictionary without a lock. Values are only appended, and
+  value_count is raised after the value is in place, so a reader sees
+  either the old count or a complete new entry. Writers from read back
+  and from statements append under dictionary_mutex.
+
+  @return
+    0, IRCON_ERROR_DICTIONARY_FULL or HA_ERR_OUT_OF_MEM.
+*/
+int Ircon_state_store::value_code(const char *value, size_t length,
+                                  int *code)
+{
+  char *copy;
+  uint count= my_atomic_load32((int32 volatile*) &value_count);
+  uint i;
+  int rc= 0;
+
+  for (i= 0; i < count; i++)
+    if (value_lengths[i] == length && !memcmp(values[i], value, length))
+    {
+      *code= (int) i;
+      return 0;
+    }
+
+  mysql_mutex_lock(&dictionary_mutex);
+  for (; i < value_count; i++)
+    if (value_lengths[i] == length && !memcmp(values[i], value, length))
+      goto end;
+  if (value_count == array_elements(values))
+  {
+    rc= IRCON_ERROR_DICTIONARY_FULL;
+    goto end;
+  }
+  if (!(copy= strmake_root(&arena, value, length)))
+  {
+    rc= HA_ERR_OUT_OF_MEM;
+    goto end;
+  }
+  values[i]= copy;
+  value_lengths[i]= (uchar) length;
+  my_atomic_store32((int32 volatile*) &value_count, (int32) i + 1);
+end:
+  mysql_mutex_unlock(&dictionary_mutex);
+  *code= (int) i;
+  return rc;
+}
+
+
+/**
+  @brief
+  Convert a column value to the code stored for a command. Every command
+  takes IRCON_COMMAND_UNKNOWN. Temperatures are decimals with at most one
+  fractional digit, power is on/off, 1/0 or true/false.
+
+  @return
+    0 on success, IRCON_ERROR_INVALID_VALUE if the value is not valid for
+    the command, IRCON_ERROR_DICTIONARY_FULL for a new mode or angle value
+    the dictionary has no room for, or HA_ERR_OUT_OF_MEM.
+*/
+int Ircon_state_store::parse(enum ircon_command command, const char *value,
+                             size_t length, int *code)
+{
+  if (length == value_lengths[0] && !memcmp(value, values[0], length))
+  {
+    *code= command == IRCON_COMMAND_ID_TEMPERATURE ? TEMPERATURE_UNKNOWN :
+           command == IRCON_COMMAND_ID_POWER ? POWER_UNKNOWN : 0;
+    return 0;
+  }
+
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+  case IRCON_COMMAND_ID_ANGLE:
+    if (length > IRCON_VALUE_LENGTH || memchr(value, ',', length) ||
+        memchr(value, '\n', length))
+      return IRCON_ERROR_INVALID_VALUE;
+    return value_code(value, length, code);
+  case IRCON_COMMAND_ID_TEMPERATURE:
+  {
+    const char *end= value + length;
+    bool negative= false;
+    int tenths= 0;
+    uint digits= 0;
+
+    if (value < end && *value == '-')
+    {
+      negative= true;
+      value++;
+    }
+    for (; value < end && my_isdigit(&my_charset_latin1, *value); value++)
+    {
+      if (++digits > 3)
+        return IRCON_ERROR_INVALID_VALUE;
+      tenths= tenths * 10 + (*value - '0');
+    }
+    tenths*= 10;
+    if (value < end && *value == '.')
+    {
+      value++;
+      if (value < end && my_isdigit(&my_charset_latin1, *value))
+        tenths+= *value++ - '0';
+    }
+    if (!digits || value != end)
+      return IRCON_ERROR_INVALID_VALUE;
+    *code= negative ? -tenths : tenths;
+    return 0;
+  }
+  case IRCON_COMMAND_ID_POWER:
+    if ((length == 2 && !native_strncasecmp(value, "on", 2)) ||
+        (length == 1 && *value == '1') ||
+        (length == 4 && !native_strncasecmp(value, "true", 4)))
+      *code= 1;
+    else if ((length == 3 && !native_strncasecmp(value, "off", 3)) ||
+             (length == 1 && *value == '0') ||
+             (length == 5 && !native_strncasecmp(value, "false", 5)))
+      *code= 0;
+    else
+      return IRCON_ERROR_INVALID_VALUE;
+    return 0;
+  case IRCON_COMMAND_ID_NONE:
+    break;
+  }
+  return IRCON_ERROR_INVALID_VALUE;
+}
+
+
+int Ircon_state_store::code(uint slot, enum ircon_command command) const
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+    return mode[slot];
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    return temperature[slot];
+  case IRCON_COMMAND_ID_POWER:
+    return power[slot];
+  case IRCON_COMMAND_ID_ANGLE:
+    return angle[slot];
+  case IRCON_COMMAND_ID_NONE:
+    break;
+  }
+  return 0;
+}
+
+
+/**
+  @brief
+  Whether the value of a command of a device is known.
+*/
+bool Ircon_state_store::known(uint slot, enum ircon_command command) const
+{
+  int value= code(slot, command);
+
+  switch (command) {
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    return value != TEMPERATURE_UNKNOWN;
+  case IRCON_COMMAND_ID_POWER:
+    return value != POWER_UNKNOWN;
+  case IRCON_COMMAND_ID_MODE:
+  case IRCON_COMMAND_ID_ANGLE:
+    return value != 0;
+  case IRCON_COMMAND_ID_NONE:
+    break;
+  }
+  return false;
+}
+
+
+void Ircon_state_store::assign(uint slot, enum ircon_command command,
+                               int code)
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+    mode[slot]= (uchar) code;
+    break;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    temperature[slot]= (int16) code;
+    break;
+  case IRCON_COMMAND_ID_POWER:
+    power[slot]= (int8) code;
+    break;
+  case IRCON_COMMAND_ID_ANGLE:
+    angle[slot]= (uchar) code;
+    break;
+  case IRCON_COMMAND_ID_NONE:
+    return;
+  }
+  /* After the change, so that an image of this version has it */
+  my_atomic_add32(&version[slot], 1);
+}
+
+
+/**
+  @brief
+  Format the state of a command into buf, which must hold
+  IRCON_VALUE_LENGTH + 1 bytes.
+
+  @return
+    The length of the value.
+*/
+size_t Ircon_state_store::get(uint slot, enum ircon_command command,
+                              char *buf) const
+{
+  return format(command, code(slot, command), buf);
+}
+
+
+/**
+  @brief
+  Format the code of a command as its column value into buf, which must
+  hold IRCON_VALUE_LENGTH + 1 bytes.
+
+  @return
+    Length of the value.
+*/
+size_t Ircon_state_store::format(enum ircon_command command, int code,
+                                 char *buf) const
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+  case IRCON_COMMAND_ID_ANGLE:
+    break;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+  {
+    int tenths= code;
+    code= 0;
+    if (tenths == TEMPERATURE_UNKNOWN)
+      break;
+    if (tenths % 10 == 0)
+      return my_snprintf(buf, IRCON_VALUE_LENGTH + 1, "%d", tenths / 10);
+    return my_snprintf(buf, IRCON_VALUE_LENGTH + 1, "%s%d.%d",
+                       tenths < 0 ? "-" : "", abs(tenths) / 10,
+                       abs(tenths) % 10);
+  }
+  case IRCON_COMMAND_ID_POWER:
+    if (code == POWER_UNKNOWN)
+    {
+      code= 0;
+      break;
+    }
+    return my_snprintf(buf, IRCON_VALUE_LENGTH + 1, "%s",
+                       code ? "on" : "off");
+  case IRCON_COMMAND_ID_NONE:
+    code= 0;
+    break;
+  }
+  memcpy(buf, values[code], value_lengths[code]);
+  buf[value_lengths[code]]= '\0';
+  return value_lengths[code];
+}
+
+
+/**
+  @brief
+  Copy the codes of a command for count slots from first on, a column at
+  a time.
+*/
+void Ircon_state_store::gather(uint first, uint count,
+                               enum ircon_command command, int *codes) const
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+    for (uint i= 0; i < count; i++)
+      codes[i]= mode[first + i];
+    break;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    for (uint i= 0; i < count; i++)
+      codes[i]= temperature[first + i];
+    break;
+  case IRCON_COMMAND_ID_POWER:
+    for (uint i= 0; i < count; i++)
+      codes[i]= power[first + i];
+    break;
+  case IRCON_COMMAND_ID_ANGLE:
+    for (uint i= 0; i < count; i++)
+      codes[i]= angle[first + i];
+    break;
+  case IRCON_COMMAND_ID_NONE:
+    memset(codes, 0, count * sizeof(*codes));
+    break;
+  }
+}
+
+
+/**
+  @brief
+  Encode the state of a command for the binary wire format into buf, which
+  must hold IRCON_VALUE_LENGTH + 1 bytes.
+
+  @return
+    The length of the encoded value.
+*/
+size_t Ircon_state_store::encode(uint slot, enum ircon_command command,
+                                 uchar *buf) const
+{
+  uint code= 0;
+
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+    code= mode[slot];
+    break;
+  case IRCON_COMMAND_ID_ANGLE:
+    code= angle[slot];
+    break;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    buf[0]= (uchar) ((uint16) temperature[slot] >> 8);
+    buf[1]= (uchar) temperature[slot];
+    return 2;
+  case IRCON_COMMAND_ID_POWER:
+    buf[0]= (uchar) power[slot];
+    return 1;
+  case IRCON_COMMAND_ID_NONE:
+    return 0;
+  }
+  buf[0]= value_lengths[code];
+  memcpy(buf + 1, values[code], value_lengths[code]);
+  return 1 + value_lengths[code];
+}
+
+
+Ircon_state_file::Ircon_state_file()
+  :file(-1), map(NULL), size(0), slot_count(0)
+{
+  mysql_mutex_init(ircon_key_mutex_Ircon_state_file_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+}
+
+
+Ircon_state_file::~Ircon_state_file()
+{
+  if (map)
+  {
+    msync(map, size, MS_SYNC);
+    munmap(map, size);
+  }
+  if (file >= 0)
+    my_close(file, MYF(0));
+  mysql_mutex_destroy(&mutex);
+}
+
+
+/**
+  @brief
+  Open or create the state file and map it. A file that is not a state
+  file of this version starts out empty.
+
+  @return
+    false on success, true on error.
+*/
+bool Ircon_state_file::open(const char *path)
+{
+  struct stat stat_info;
+  DBUG_ENTER("Ircon_state_file::open");
+
+  if ((file= my_open(path, O_RDWR | O_CREAT, MYF(MY_WME))) < 0 ||
+      fstat(file, &stat_info))
+    DBUG_RETURN(true);
+  if ((size_t) stat_info.st_size >= header_length())
+  {
+    size= (size_t) stat_info.st_size;
+    if ((map= (uchar*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            file, 0)) == MAP_FAILED)
+    {
+      map= NULL;
+      DBUG_RETURN(true);
+    }
+    if (!memcmp(map, IRCON_STATE_MAGIC, IRCON_STATE_MAGIC_LENGTH) &&
+        uint4korr(map + IRCON_STATE_MAGIC_LENGTH) ==
+        sizeof(Ircon_state_record))
+    {
+      slot_count= (uint) ((size - header_length()) /
+                          sizeof(Ircon_state_record));
+      DBUG_RETURN(false);
+    }
+  }
+  /* New or foreign: start over with room for a few devices */
+  if (grow(8))
+    DBUG_RETURN(true);
+  memcpy(map, IRCON_STATE_MAGIC, IRCON_STATE_MAGIC_LENGTH);
+  int4store(map + IRCON_STATE_MAGIC_LENGTH, sizeof(Ircon_state_record));
+  memset(map + header_length(), 0, size - header_length());
+  DBUG_RETURN(false);
+}
+
+
+/**
+  @brief
+  Extend the file and its mapping to hold at least the given number of
+  slots. Must be called with mutex held, or before the share is in use.
+*/
+bool Ircon_state_file::grow(uint slots)
+{
+  uint count= MY_MAX(slots, slot_count * 2);
+  size_t new_size= header_length() + count * sizeof(Ircon_state_record);
+  uchar *new_map;
+
+  if (my_chsize(file, new_size, 0, MYF(MY_WME)) ||
+      (new_map= (uchar*) mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, file, 0)) == MAP_FAILED)
+    return true;
+  if (map)
+    munmap(map, size);
+  map= new_map;
+  size= new_size;
+  slot_count= count;
+  return false;
+}
+
+
+/**
+  @brief
+  Write the state of a device slot. Device keys too long to keep are not
+  saved.
+*/
+void Ircon_state_file::save(uint slot, const char *name, uint name_length,
+                            const Ircon_state_store *state)
+{
+  char value[IRCON_VALUE_LENGTH + 1];
+  Ircon_state_record *rec;
+  size_t length;
+
+  if (!map || name_length > IRCON_STATE_NAME_LENGTH)
+    return;
+  mysql_mutex_lock(&mutex);
+  if (slot >= slot_count && grow(slot + 1))
+  {
+    mysql_mutex_unlock(&mutex);
+    return;
+  }
+  rec= (Ircon_state_record*) record(slot);
+  rec->name_length= (uchar) name_length;
+  memcpy(rec->name, name, name_length);
+  length= state->get(slot, IRCON_COMMAND_ID_MODE, value);
+  rec->mode_length= (uchar) MY_MIN(length, sizeof(rec->mode));
+  memcpy(rec->mode, value, rec->mode_length);
+  length= state->get(slot, IRCON_COMMAND_ID_ANGLE, value);
+  rec->angle_length= (uchar) MY_MIN(length, sizeof(rec->angle));
+  memcpy(rec->angle, value, rec->angle_length);
+  rec->temperature= (int16) state->code(slot, IRCON_COMMAND_ID_TEMPERATURE);
+  rec->power= (int8) state->code(slot, IRCON_COMMAND_ID_POWER);
+  rec->used= 1;
+  mysql_mutex_unlock(&mutex);
+}
+
+
+void Ircon_state_file::clear(uint slot)
+{
+  if (!map)
+    return;
+  mysql_mutex_lock(&mutex);
+  if (slot < slot_count)
+    ((Ircon_state_record*) record(slot))->used= 0;
+  mysql_mutex_unlock(&mutex);
+}
+
+
+Ircon_share::Ircon_share()
+  :multi_device(false), dedup_ttl(-1), wire_format(-1), rate_limit(-1),
+   schedule_field(-1), device_field(0), devices(NULL),
+   retired_devices(NULL), locked(0), devices_size(0), device_slots(0),
+   device_count(0), next_device_id(0)
+{
+  thr_lock_init(&lock);
+  my_hash_clear(&device_index);
+  mysql_mutex_init(ircon_key_mutex_Ircon_share_devices_mutex, &devices_mutex,
+                   MY_MUTEX_INIT_FAST);
+  mysql_rwlock_init(ircon_key_rwlock_Ircon_share_state_lock, &state_lock);
+  init_alloc_root(ircon_key_memory_devices, &devices_arena, 1024, 0);
+}
+
+
+/**
+  @brief
+  Free a device that is no longer in the share.
+*/
+static void ircon_free_device(Ircon_device *device)
+{
+  ircon_release_connection(device->connection);
+  mysql_mutex_destroy(&device->mutex);
+  my_free(device->image);
+  my_free(device);
+}
+
+
+Ircon_share::~Ircon_share()
+{
+  for (uint slot= 0; slot < device_slots; slot++)
+    if (devices[slot])
+      remove_device(devices[slot]);
+  while (retired_devices)
+  {
+    Ircon_device *device= retired_devices;
+    retired_devices= device->next_retired;
+    ircon_free_device(device);
+  }
+  free_root(&devices_arena, MYF(0));
+  my_hash_free(&device_index);
+  mysql_rwlock_destroy(&state_lock);
+  mysql_mutex_destroy(&devices_mutex);
+  thr_lock_delete(&lock);
+}
+
+
+static uchar* ircon_device_get_key(Ircon_device *device, size_t *length,
+                                   my_bool not_used MY_ATTRIBUTE((unused)))
+{
+  *length= device->name_length;
+  return (uchar*) device->name;
+}
+
+
+/**
+  @brief
+  Return true if the table has one row per device, i.e. its only key is a
+  PRIMARY KEY on the device column.
+*/
+bool ircon_is_multi_device(TABLE_SHARE *table_share)
+{
+  KEY *key;
+
+  if (table_share->keys != 1 || table_share->primary_key == MAX_KEY)
+    return false;
+  key= &table_share->key_info[table_share->primary_key];
+  return key->user_defined_key_parts == 1 &&
+         !my_strcasecmp(system_charset_info, key->key_part[0].field->field_name,
+                        IRCON_COLUMN_DEVICE);
+}
+
+
+/**
+  @brief
+  Find a name=value option in a table COMMENT. Options are separated by
+  spaces or commas.
+
+  @return
+    true if the option is present, with value and length set.
+*/
+static bool ircon_comment_option(const LEX_STRING *comment, const char *name,
+                                 const char **value, size_t *length)
+{
+  size_t name_length= strlen(name);
+  const char *end= comment->str + comment->length;
+
+  for (const char *pos= comment->str; pos < end;)
+  {
+    const char *token= pos;
+    while (pos < end && *pos != ' ' && *pos != ',')
+      pos++;
+    if ((size_t) (pos - token) > name_length && token[name_length] == '=' &&
+        !native_strncasecmp(token, name, name_length))
+    {
+      *value= token + name_length + 1;
+      *length= pos - *value;
+      return true;
+    }
+    while (pos < end && (*pos == ' ' || *pos == ','))
+      pos++;
+  }
+  return false;
+}
+
+
+/**
+  @brief
+  Read a numeric table COMMENT option.
+
+  @return
+    The value, or -1 if the option is absent or not a number.
+*/
+static long ircon_comment_number(const LEX_STRING *comment, const char *name)
+{
+  const char *value;
+  size_t length;
+  long number= 0;
+
+  if (!ircon_comment_option(comment, name, &value, &length) || !length ||
+      length > 9)
+    return -1;
+  for (size_t i= 0; i < length; i++)
+  {
+    if (!my_isdigit(&my_charset_latin1, value[i]))
+      return -1;
+    number= number * 10 + (value[i] - '0');
+  }
+  return number;
+}
+
+
+/**
+  @brief
+  Set up the device list. A single-device table gets its one device, named
+  by the table, right away; a multi-device table starts out empty. Both
+  then get the devices and state kept in the table's state file.
+
+  @return
+    0 on success, an HA_ERR_ code otherwise.
+*/
+int Ircon_share::init(TABLE_SHARE *table_share)
+{
+  Ircon_device *device;
+  const char *value;
+  size_t length;
+  char path[FN_REFLEN];
+  int rc;
+  DBUG_ENTER("Ircon_share::init");
+
+  if (my_hash_init(&device_index, &my_charset_bin, 32, 0, 0,
+                   (my_hash_get_key) ircon_device_get_key, 0, 0,
+                   ircon_key_memory_devices))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  dedup_ttl= ircon_comment_number(&table_share->comment, "dedup_ttl");
+  rate_limit= ircon_comment_number(&table_share->comment, "rate_limit");
+  for (uint i= 0; i < table_share->fields; i++)
+  {
+    Field *field= table_share->field[i];
+    if ((field->type() == MYSQL_TYPE_DATETIME ||
+         field->type() == MYSQL_TYPE_TIMESTAMP) &&
+        !my_strcasecmp(system_charset_info, field->field_name,
+                       IRCON_COLUMN_SCHEDULE))
+      schedule_field= (int) i;
+  }
+  if (ircon_comment_option(&table_share->comment, "wire_format", &value,
+                           &length))
+  {
+    if (length == 4 && !native_strncasecmp(value, "text", 4))
+      wire_format= IRCON_WIRE_FORMAT_TEXT;
+    else if (length == 6 && !native_strncasecmp(value, "binary", 6))
+      wire_format= IRCON_WIRE_FORMAT_BINARY;
+  }
+
+  if ((multi_device= ircon_is_multi_device(table_share)))
+  {
+    KEY *key= &table_share->key_info[table_share->primary_key];
+    device_field= key->key_part[0].fieldnr - 1;
+  }
+  else if ((rc= add_device(table_share->table_name.str,
+                           (uint) table_share->table_name.length, &device)))
+    DBUG_RETURN(rc);
+
+  fn_format(path, table_share->normalized_path.str, "", IRCON_STATE_EXT,
+            MY_UNPACK_FILENAME | MY_APPEND_EXT);
+  if (state_file.open(path))
+    sql_print_warning("IRCON: cannot open state file '%s', the device state "
+                      "of the table is not kept", path);
+  else
+    load_state();
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Restore the devices and their last known state from the state file.
+  Restored devices may get other slots than they had, so the file is
+  written back to match.
+*/
+void Ircon_share::load_state()
+{
+  uint slots= state_file.slots();
+  DBUG_ENTER("Ircon_share::load_state");
+
+  for (uint i= 0; i < slots; i++)
+  {
+    Ircon_state_record rec= *state_file.record(i);
+    Ircon_device *device;
+    int code;
+
+    if (!rec.used || rec.name_length > IRCON_STATE_NAME_LENGTH)
+      continue;
+    if (!multi_device)
+    {
+      if (i)
+        continue;
+      device= devices[0];
+    }
+    else if (find_device(rec.name, rec.name_length) ||
+             add_device(rec.name, rec.name_length, &device))
+      continue;
+    if (!state.parse(IRCON_COMMAND_ID_MODE, rec.mode, rec.mode_length, &code))
+      state.assign(device->slot, IRCON_COMMAND_ID_MODE, code);
+    if (!state.parse(IRCON_COMMAND_ID_ANGLE, rec.angle, rec.angle_length,
+                     &code))
+      state.assign(device->slot, IRCON_COMMAND_ID_ANGLE, code);
+    state.assign(device->slot, IRCON_COMMAND_ID_TEMPERATURE, rec.temperature);
+    state.assign(device->slot, IRCON_COMMAND_ID_POWER, rec.power);
+  }
+
+  for (uint i= 0; i < slots; i++)
+    state_file.clear(i);
+  for (uint slot= 0; slot < device_slots; slot++)
+    if (devices[slot])
+      save_state(devices[slot]);
+  DBUG_VOID_RETURN;
+}
+
+
+void Ircon_share::save_state(Ircon_device *device)
+{
+  state_file.save(device->slot, device->name, device->name_length, &state);
+}
+
+
+void Ircon_share::forget_state(Ircon_device *device)
+{
+  state_file.clear(device->slot);
+}
+
+
+Ircon_device *Ircon_share::find_device(const char *name, uint length)
+{
+  Ircon_device *device;
+
+  mysql_mutex_lock(&devices_mutex);
+  device= (Ircon_device*) my_hash_search(&device_index, (const uchar*) name,
+                                         length);
+  mysql_mutex_unlock(&devices_mutex);
+  return device;
+}
+
+
+/**
+  @brief
+  Add a device with unknown state in the first free slot and get its
+  pooled connection.
+
+  @return
+    0 on success, HA_ERR_FOUND_DUPP_KEY if a concurrent statement added
+    the key first, HA_ERR_OUT_OF_MEM otherwise.
+*/
+int Ircon_share::add_device(const char *name, uint length,
+                            Ircon_device **device)
+{
+  char endpoint[IRCON_ENDPOINT_LENGTH];
+  uint endpoint_length;
+  struct sockaddr_storage addr;
+  socklen_t addr_length;
+  Ircon_device *tmp;
+  uint slot;
+  int rc= HA_ERR_OUT_OF_MEM;
+  DBUG_ENTER("Ircon_share::add_device");
+
+  if (!(tmp= (Ircon_device*) my_malloc(ircon_key_memory_devices,
+                                       sizeof(Ircon_device) + length + 1,
+                                       MYF(MY_WME | MY_ZEROFILL))))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  tmp->name= (char*) (tmp + 1);
+  tmp->name_length= length;
+  memcpy(tmp->name, name, length);
+  tmp->name[length]= '\0';
+  endpoint_length= ircon_canonical_endpoint(name, length, endpoint);
+  /*
+    Resolve a new endpoint here, once, so that connects find it in the
+    cache. One that fails or is resolving elsewhere is left to the
+    resolver thread, connects fail until it has an address.
+  */
+  ircon_resolver.lookup(endpoint, endpoint_length, &addr, &addr_length, true);
+  if (!(tmp->connection= ircon_acquire_connection(endpoint, endpoint_length)))
+  {
+    my_free(tmp);
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  }
+  mysql_mutex_init(ircon_key_mutex_Ircon_device_mutex, &tmp->mutex,
+                   MY_MUTEX_INIT_FAST);
+
+  mysql_mutex_lock(&devices_mutex);
+  if (my_hash_search(&device_index, (const uchar*) name, length))
+  {
+    rc= HA_ERR_FOUND_DUPP_KEY;
+    goto err;
+  }
+  for (slot= 0; slot < device_slots && devices[slot]; slot++)
+  {}
+  if (slot == devices_size)
+  {
+    /* Scans may still read the old array, it stays in devices_arena */
+    uint size= devices_size ? devices_size * 2 : 8;
+    Ircon_device **tmp_devices;
+    if (!(tmp_devices= (Ircon_device**) alloc_root(&devices_arena,
+                                                   size * sizeof(*devices))))
+      goto err;
+    memcpy(tmp_devices, devices, devices_size * sizeof(*devices));
+    memset(tmp_devices + devices_size, 0,
+           (size - devices_size) * sizeof(*devices));
+    my_atomic_storeptr((void * volatile *) &devices, tmp_devices);
+    devices_size= size;
+  }
+  if (slot >= state.capacity)
+  {
+    bool failed;
+    mysql_rwlock_wrlock(&state_lock);
+    failed= state.reserve(slot + 1);
+    mysql_rwlock_unlock(&state_lock);
+    if (failed)
+      goto err;
+  }
+  if (my_hash_insert(&device_index, (uchar*) tmp))
+    goto err;
+
+  tmp->slot= slot;
+  tmp->id= ++next_device_id;
+  state.reset(slot);
+  devices[slot]= tmp;
+  if (slot == device_slots)
+    device_slots++;
+  device_count++;
+  mysql_mutex_unlock(&devices_mutex);
+  *device= tmp;
+  DBUG_RETURN(0);
+
+err:
+  mysql_mutex_unlock(&devices_mutex);
+  ircon_free_device(tmp);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Take a device out of the slot array and the key index.
+*/
+void Ircon_share::unlink_device(Ircon_device *device)
+{
+  mysql_mutex_lock(&devices_mutex);
+  my_hash_delete(&device_index, (uchar*) device);
+  devices[device->slot]= NULL;
+  while (device_slots && !devices[device_slots - 1])
+    device_slots--;
+  device_count--;
+  mysql_mutex_unlock(&devices_mutex);
+}
+
+
+/**
+  @brief
+  Remove a device and free it. Only safe while no other statement can
+  hold the device, i.e. under an exclusive table lock.
+*/
+void Ircon_share::remove_device(Ircon_device *device)
+{
+  DBUG_ENTER("Ircon_share::remove_device");
+  unlink_device(device);
+  ircon_free_device(device);
+  DBUG_VOID_RETURN;
+}
+
+
+/**
+  @brief
+  Remove a device another statement may still hold. It keeps its
+  connection until reclaim_devices() frees it; writers find it no longer
+  in its slot and leave the slot's new device alone. The caller holds the
+  device's mutex.
+*/
+void Ircon_share::retire_device(Ircon_device *device)
+{
+  DBUG_ENTER("Ircon_share::retire_device");
+  unlink_device(device);
+  mysql_mutex_lock(&devices_mutex);
+  device->next_retired= retired_devices;
+  retired_devices= device;
+  mysql_mutex_unlock(&devices_mutex);
+  DBUG_VOID_RETURN;
+}
+
+
+/**
+  @brief
+  Free the retired devices once no handler of the share is locked.
+
+  @details
+  Statements only get hold of devices while their handler is locked, and
+  a retired device is out of the slots and the index, so a statement
+  locking the table later never finds it. A device retired while the
+  count is raised may still be held by the statements counted, but with
+  the count at 0 under devices_mutex every device retired before is free
+  to go.
+*/
+void Ircon_share::reclaim_devices()
+{
+  Ircon_device *list;
+  DBUG_ENTER("Ircon_share::reclaim_devices");
+
+  mysql_mutex_lock(&devices_mutex);
+  if (my_atomic_load32(&locked))
+  {
+    mysql_mutex_unlock(&devices_mutex);
+    DBUG_VOID_RETURN;
+  }
+  list= retired_devices;
+  retired_devices= NULL;
+  mysql_mutex_unlock(&devices_mutex);
+  while (list)
+  {
+    Ircon_device *device= list;
+    list= device->next_retired;
+    ircon_free_device(device);
+  }
+  DBUG_VOID_RETURN;
+}
+
+
+static const char *durability_names[]=
+{
+  "sync", "async", NullS
+};
+
+static TYPELIB durability_typelib=
+{
+  array_elements(durability_names) - 1, "durability_typelib",
+  durability_names, NULL
+};
+
+enum ircon_durability
+{
+  IRCON_DURABILITY_SYNC,        ///< Send on the client thread
+  IRCON_DURABILITY_ASYNC        ///< Hand the command to the event loop
+};
+
+static ulong srv_durability= IRCON_DURABILITY_SYNC;
+
+static MYSQL_SYSVAR_ENUM(
+  durability,
+  srv_durability,
+  PLUGIN_VAR_RQCMDARG,
+  "sync: a statement returns after its device commands are sent. "
+  "async: commands are queued for the event loop threads and the "
+  "statement returns at once.",
+  NULL,
+  NULL,
+  IRCON_DURABILITY_SYNC,
+  &durability_typelib);
+
+static const char *wire_format_names[]=
+{
+  "text", "binary", NullS
+};
+
+static TYPELIB wire_format_typelib=
+{
+  array_elements(wire_format_names) - 1, "wire_format_typelib",
+  wire_format_names, NULL
+};
+
+static ulong srv_wire_format= IRCON_WIRE_FORMAT_TEXT;
+
+static MYSQL_SYSVAR_ENUM(
+  wire_format,
+  srv_wire_format,
+  PLUGIN_VAR_RQCMDARG,
+  "text: commands are name:value lines. binary: commands are compact "
+  "frames with one byte command ids. A wire_format=text|binary table "
+  "COMMENT overrides it.",
+  NULL,
+  NULL,
+  IRCON_WIRE_FORMAT_TEXT,
+  &wire_format_typelib);
+
+static ulong srv_queue_size= 1024;
+
+static MYSQL_SYSVAR_ULONG(
+  queue_size,
+  srv_queue_size,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Number of asynchronous commands a device connection holds before "
+  "statements wait for them to be written.",
+  NULL,
+  NULL,
+  1024,
+  16,
+  1024 * 1024,
+  0);
+
+static ulong srv_event_threads= 1;
+
+static MYSQL_SYSVAR_ULONG(
+  event_threads,
+  srv_event_threads,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Number of event loop threads writing asynchronous commands and watching "
+  "device sockets.",
+  NULL,
+  NULL,
+  1,
+  1,
+  64,
+  0);
+
+static ulong srv_pipeline_window= 0;
+
+static MYSQL_SYSVAR_ULONG(
+  pipeline_window,
+  srv_pipeline_window,
+  PLUGIN_VAR_RQCMDARG,
+  "Number of sequence-numbered commands that may wait for an ack per "
+  "device connection. 0 sends commands without sequence numbers or acks.",
+  NULL,
+  NULL,
+  0,
+  0,
+  65536,
+  0);
+
+/* Room for the "seq:N," prefix of a pipelined command */
+#define IRCON_SEQ_PREFIX_LENGTH 32
+
+/* Pipelined commands acknowledged, and those whose ack never came */
+static int64 ircon_commands_acked= 0;
+static int64 ircon_commands_unacked= 0;
+
+static Ircon_event_loop *ircon_event_loops= NULL;
+static ulong ircon_event_loop_count= 0;
+static volatile int32 ircon_next_event_loop= 0;
+static volatile int32 ircon_event_loops_stop= 0;
+
+/* Times a statement had to wait for a connection's output to drain */
+static int64 ircon_queue_full_waits= 0;
+
+/* Asynchronous commands that could not be sent */
+static int64 ircon_async_send_errors= 0;
+
+/* Loops check pending connects for timeouts this often, in milliseconds */
+#define IRCON_EVENT_LOOP_TICK 100
+
+
+/**
+  @brief
+  Account for commands and bytes written to the device.
+*/
+void Ircon_connection::account_sent(ulonglong commands, size_t bytes,
+                                    ulonglong now)
+{
+  mysql_mutex_assert_owner(&mutex);
+  commands_sent+= commands;
+  bytes_sent+= bytes;
+  ircon_commands_sent.add((int64) commands);
+  ircon_bytes_sent.add((int64) bytes);
+  if (commands)
+  {
+    send_rate= send_rate * exp(-(double) (now - send_rate_at) /
+                               (IRCON_RATE_WINDOW * 1000000.0)) +
+               commands / IRCON_RATE_WINDOW;
+    send_rate_at= now;
+    last_sent_at= (time_t) (now / 1000000);
+  }
+}
+
+
+/**
+  @brief
+  Register the socket with the event loop for the events it is waiting
+  for: writability while a connect is pending or output is queued,
+  readability while acks or the answer to a query are due. Errors and
+  hangups are always reported. Must be called with mutex held.
+*/
+void Ircon_connection::update_events()
+{
+  struct epoll_event event;
+  uint32 wanted;
+
+  mysql_mutex_assert_owner(&mutex);
+  if (!loop || mysql_socket_getfd(socket) == INVALID_SOCKET)
+    return;
+  wanted= (state == IRCON_CONNECTION_CONNECTING ||
+           output_start < output_end) ? EPOLLOUT : 0;
+  if (state == IRCON_CONNECTION_CONNECTED &&
+      (next_seq - 1 > MY_MAX(acked_seq, lost_seq) || querying))
+    wanted|= EPOLLIN;
+  if (registered && wanted == events)
+    return;
+  event.events= wanted;
+  event.data.ptr= this;
+  if (!epoll_ctl(loop->epoll_fd, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                 mysql_socket_getfd(socket), &event))
+  {
+    registered= true;
+    events= wanted;
+  }
+}
+
+
+/**
+  @brief
+  Discard the queued output after a failure.
+*/
+void Ircon_connection::drop_output()
+{
+  mysql_mutex_assert_owner(&mutex);
+  if (queued)
+  {
+    my_atomic_add64(&ircon_async_send_errors, queued);
+    my_atomic_add64(&ircon_output_depth, -queued);
+    my_atomic_store32(&queued, 0);
+  }
+  output_start= output_end= 0;
+  dropped_seq= output_seq;
+  complete_journal();
+  mysql_cond_broadcast(&drained);
+}
+
+
+/**
+  @brief
+  Journal a line appended to output. Must be called with mutex held.
+*/
+void Ircon_connection::journal_line(const char *line, size_t length)
+{
+  size_t offset;
+
+  mysql_mutex_assert_owner(&mutex);
+  /* Make room first, a record that could not be completed is never freed */
+  if (journal_record_count == journal_record_size)
+  {
+    uint size= MY_MAX(journal_record_size * 2, 16);
+    size_t *records;
+    if (!(records= (size_t*) my_realloc(ircon_key_memory_command_queue,
+                                        journal_records,
+                                        size * sizeof(*records),
+                                        MYF(MY_WME | MY_ALLOW_ZERO_PTR))))
+      return;
+    journal_records= records;
+    journal_record_size= size;
+  }
+  if ((offset= ircon_journal.append(endpoint, endpoint_length, line,
+                                    length)))
+    journal_records[journal_record_count++]= offset;
+}
+
+
+/**
+  @brief
+  Mark the journal records of the output done, once it is written or
+  dropped. Must be called with mutex held.
+*/
+void Ircon_connection::complete_journal()
+{
+  mysql_mutex_assert_owner(&mutex);
+  if (journal_record_count)
+  {
+    ircon_journal.complete(journal_records, journal_record_count);
+    journal_record_count= 0;
+  }
+}
+
+
+/**
+  @brief
+  Write the queued output: as much as the socket takes without blocking
+  for the event loop, or all of it when wait is set. Must be called with
+  mutex held.
+
+  @details
+  A failed write drops the rest of the output: the device may have seen
+  part of a line, and resending it on a new connection could not be told
+  apart from a new command.
+*/
+void Ircon_connection::write_output(bool wait)
+{
+  size_t written= 0;
+  int calls= 0;
+  int flags= wait ? MSG_NOSIGNAL : MSG_DONTWAIT | MSG_NOSIGNAL;
+
+  mysql_mutex_assert_owner(&mutex);
+  while (output_start < output_end)
+  {
+    ssize_t sent= mysql_socket_send(socket, output + output_start,
+                                    output_end - output_start, flags);
+    calls++;
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      disconnect();
+      drop_output();
+      break;
+    }
+    output_start+= sent;
+    written+= sent;
+  }
+  my_atomic_add64(&ircon_send_syscalls_saved, -calls);
+  if (output_start == output_end && queued)
+  {
+    int32 commands= queued;
+    output_start= output_end= 0;
+    written_seq= output_seq;
+    complete_journal();
+    my_atomic_store32(&queued, 0);
+    my_atomic_add64(&ircon_output_depth, -commands);
+    account_sent(commands, written, my_micro_time());
+    mysql_cond_broadcast(&drained);
+  }
+  else if (written)
+    account_sent(0, written, my_micro_time());
+}
+
+
+/**
+  @brief
+  Append a command to the output for the event loop to write. A
+  connection holding ircon_queue_size commands makes the caller wait
+  rather than reorder or drop commands.
+
+  @param seq      If set, number the command for ircon_pipeline_window and
+                  return its sequence number to wait_ack() for
+  @param written  If set, return the output line number to wait_written()
+                  for
+
+  @return
+    0 on success, HA_ERR_OUT_OF_MEM, or IRCON_ERROR_CIRCUIT_OPEN for a
+    command to wait for while the circuit breaker is open. Send errors of
+    asynchronous commands are only counted, in ircon_async_send_errors or,
+    for an open breaker, ircon_breaker_rejects.
+*/
+int Ircon_connection::queue_line(const char *line, size_t length,
+                                 int unbatched_calls, ulonglong *seq,
+                                 ulonglong *written)
+{
+  int rc;
+  DBUG_ENTER("Ircon_connection::queue_line");
+
+  mysql_mutex_lock(&mutex);
+  if (breaker_open())
+  {
+    my_atomic_add64(&ircon_breaker_rejects, 1);
+    mysql_mutex_unlock(&mutex);
+    DBUG_RETURN(seq || written ? IRCON_ERROR_CIRCUIT_OPEN : 0);
+  }
+  if ((ulong) queued >= srv_queue_size)
+  {
+    IRCON_STAGE(&ircon_stage_waiting_for_output);
+    ulonglong deadline= my_micro_time() + (ulonglong) srv_read_timeout * 1000;
+    my_atomic_add64(&ircon_queue_full_waits, 1);
+    while ((ulong) queued >= srv_queue_size)
+    {
+      struct timespec abstime;
+      if (my_micro_time() >= deadline)
+      {
+        /* The device stopped reading, start over with the new command */
+        disconnect();
+        drop_output();
+        break;
+      }
+      set_timespec_nsec(abstime, 10000000ULL);
+      mysql_cond_timedwait(&drained, &mutex, &abstime);
+    }
+  }
+  if (seq)
+  {
+    ulong window= MY_MAX(srv_pipeline_window, 1);
+    ulonglong deadline= my_micro_time() + (ulonglong) srv_read_timeout * 1000;
+    while (next_seq - 1 - MY_MAX(acked_seq, lost_seq) >= window)
+    {
+      struct timespec abstime;
+      if (my_micro_time() >= deadline)
+      {
+        /* The acks are overdue, give up on them and start over */
+        disconnect();
+        break;
+      }
+      set_timespec_nsec(abstime, 10000000ULL);
+      mysql_cond_timedwait(&drained, &mutex, &abstime);
+    }
+  }
+  rc= append_output(line, length, unbatched_calls, seq, written);
+  mysql_mutex_unlock(&mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Append a line to output and have it written, numbered if seq is given.
+  Must be called with mutex held.
+
+  @param command  The line is a device command: it is journaled, see
+                  ircon_journal_file, and shown as the last command in
+                  IRCON_DEVICES. A query is neither, there is nothing to
+                  replay it for and it changes nothing on the device.
+
+  @return
+    0, or HA_ERR_OUT_OF_MEM.
+*/
+int Ircon_connection::append_output(const char *line, size_t length,
+                                    int unbatched_calls, ulonglong *seq,
+                                    ulonglong *written, bool command)
+{
+  size_t needed= length + (seq ? IRCON_SEQ_PREFIX_LENGTH : 0);
+
+  if (output_end + needed > output_size)
+  {
+    memmove(output, output + output_start, output_end - output_start);
+    output_end-= output_start;
+    output_start= 0;
+    if (output_end + needed > output_size)
+    {
+      size_t size= MY_MAX(output_size * 2, output_end + needed);
+      uchar *tmp;
+      size= MY_MAX(size, 16 * IRCON_COMMAND_LINE_LENGTH);
+      if (!(tmp= (uchar*) my_realloc(ircon_key_memory_command_queue, output,
+                                     size, MYF(MY_WME | MY_ALLOW_ZERO_PTR))))
+        return HA_ERR_OUT_OF_MEM;
+      output= tmp;
+      output_size= size;
+    }
+  }
+  if (seq && (uchar) line[0] == IRCON_FRAME_MAGIC)
+  {
+    /* A frame carries its number as the first command */
+    uchar *frame= output + output_end;
+    *seq= next_seq++;
+    frame[0]= IRCON_FRAME_MAGIC;
+    frame[1]= (uchar) ((uchar) line[1] + 9);
+    frame[2]= IRCON_FRAME_SEQ;
+    for (uint i= 0; i < 8; i++)
+      frame[3 + i]= (uchar) (*seq >> (56 - 8 * i));
+    output_end+= IRCON_FRAME_HEADER_LENGTH + 9;
+    memcpy(output + output_end, line + IRCON_FRAME_HEADER_LENGTH,
+           length - IRCON_FRAME_HEADER_LENGTH);
+    output_end+= length - IRCON_FRAME_HEADER_LENGTH;
+  }
+  else
+  {
+    if (seq)
+    {
+      *seq= next_seq++;
+      output_end+= my_snprintf((char*) output + output_end,
+                               IRCON_SEQ_PREFIX_LENGTH, "seq:%llu,", *seq);
+    }
+    memcpy(output + output_end, line, length);
+    output_end+= length;
+  }
+  if (command && ircon_journal.map)
+    journal_line(line, length);
+  if (written)
+    *written= output_seq + 1;
+  output_seq++;
+  my_atomic_add32(&queued, 1);
+  my_atomic_add64(&ircon_output_depth, 1);
+  my_atomic_add64(&ircon_send_syscalls_saved, unbatched_calls);
+  if (command)
+  {
+    last_command_length= (uint) MY_MIN(length, sizeof(last_command));
+    memcpy(last_command, line, last_command_length);
+  }
+
+  if (state == IRCON_CONNECTION_CLOSED || state == IRCON_CONNECTION_FAILED)
+  {
+    if (start_connect())
+      drop_output();
+  }
+  else
+    update_events();
+  return 0;
+}
+
+
+/**
+  @brief
+  Take a token of the endpoint's bucket, refilled at rate tokens a second
+  and holding ircon_rate_burst of them. The bucket is kept as the time it
+  is full again, advanced by a compare and swap, so writers to the
+  endpoint never wait on each other for it.
+
+  @return
+    true if a command may be sent now.
+*/
+bool Ircon_connection::take_token(ulong rate, ulonglong now)
+{
+  int64 interval= 1000000 / (int64) rate;
+  int64 limit= interval * (int64) srv_rate_burst;
+  int64 full_at= my_atomic_load64(&rate_tat);
+
+  for (;;)
+  {
+    int64 next= MY_MAX(full_at, (int64) now) + interval;
+    if (next - (int64) now > limit)
+      return false;
+    if (my_atomic_cas64(&rate_tat, &full_at, next))
+      return true;
+  }
+}
+
+
+/**
+  @brief
+  Whether a command may be sent now under a rate limit of rate commands a
+  second. It may not while an earlier one is deferred, so that the device
+  never gets a newer command before an older one.
+*/
+bool Ircon_connection::admit(ulong rate)
+{
+  return !my_atomic_load32(&deferred) && take_token(rate, my_micro_time());
+}
+
+
+/**
+  @brief
+  Hold a line back until the rate limit lets it through. The endpoint
+  keeps one deferred line: a newer one replaces it, so the device gets the
+  newest state once its bucket has a token, not every step to it.
+
+  @param ticket  Set to the number of the deferred line to wait_deferred()
+                 for. A line replacing another keeps its number.
+
+  @return
+    0, HA_ERR_OUT_OF_MEM, or IRCON_ERROR_CIRCUIT_OPEN for a synchronous
+    command to an endpoint whose circuit breaker is open.
+*/
+int Ircon_connection::defer_line(const char *line, size_t length,
+                                 ulong rate, ulonglong *ticket)
+{
+  DBUG_ENTER("Ircon_connection::defer_line");
+
+  mysql_mutex_lock(&mutex);
+  if (breaker_open())
+  {
+    my_atomic_add64(&ircon_breaker_rejects, 1);
+    mysql_mutex_unlock(&mutex);
+    DBUG_RETURN(srv_durability != IRCON_DURABILITY_ASYNC ?
+                IRCON_ERROR_CIRCUIT_OPEN : 0);
+  }
+  if (length > deferred_size)
+  {
+    size_t size= MY_MAX(length, IRCON_COMMAND_LINE_LENGTH);
+    char *tmp;
+    if (!(tmp= (char*) my_realloc(ircon_key_memory_command_queue,
+                                  deferred_line, size,
+                                  MYF(MY_WME | MY_ALLOW_ZERO_PTR))))
+    {
+      mysql_mutex_unlock(&mutex);
+      DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+    }
+    deferred_line= tmp;
+    deferred_size= size;
+  }
+  if (deferred)
+    my_atomic_add64(&ircon_commands_coalesced, 1);
+  else
+  {
+    deferred_ticket++;
+    my_atomic_add64(&ircon_output_depth, 1);
+    my_atomic_store32(&deferred, 1);
+  }
+  my_atomic_add64(&ircon_commands_deferred, 1);
+  memcpy(deferred_line, line, length);
+  deferred_length= length;
+  deferred_rate= rate;
+  *ticket= deferred_ticket;
+  mysql_mutex_unlock(&mutex);
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Queue the deferred line once the bucket has a token, called by the event
+  loop every tick. The line goes out unnumbered, so the loop never waits
+  for the pipeline window; the endpoint's later commands are acked as
+  usual. A line whose token comes while the circuit breaker is open is
+  dropped and counted in ircon_deferred_dropped.
+*/
+void Ircon_connection::release_deferred(ulonglong now)
+{
+  if (!my_atomic_load32(&deferred))
+    return;
+  mysql_mutex_lock(&mutex);
+  if (deferred && (breaker_open() || take_token(deferred_rate, now)))
+  {
+    released_line= 0;
+    if (breaker_open())
+    {
+      my_atomic_add64(&ircon_breaker_rejects, 1);
+      my_atomic_add64(&ircon_deferred_dropped, 1);
+    }
+    else if (append_output(deferred_line, deferred_length, 0, NULL,
+                           &released_line))
+    {
+      my_atomic_add64(&ircon_deferred_dropped, 1);
+      released_line= 0;
+    }
+    released_ticket= deferred_ticket;
+    my_atomic_store32(&deferred, 0);
+    my_atomic_add64(&ircon_output_depth, -1);
+    mysql_cond_broadcast(&drained);
+  }
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Wait for a deferred line to get its token and be written. A token is
+  due within one interval of the rate limit, so this waits that long
+  plus ircon_read_timeout. A line replaced before its release is covered
+  by the one that replaced it; one released before a later line is
+  covered by that line being written, output is written in order.
+
+  @return
+    0 once it was written, HA_ERR_NO_CONNECTION if it was dropped or
+    timed out.
+*/
+int Ircon_connection::wait_deferred(ulonglong ticket)
+{
+  struct timespec abstime;
+  ulonglong line= 0;
+  int rc= 0;
+  DBUG_ENTER("Ircon_connection::wait_deferred");
+  IRCON_STAGE(&ircon_stage_waiting_for_rate_limit);
+
+  mysql_mutex_lock(&mutex);
+  set_timespec_nsec(abstime,
+                    (1000000ULL / MY_MAX(deferred_rate, 1) +
+                     IRCON_EVENT_LOOP_TICK * 1000ULL +
+                     (ulonglong) srv_read_timeout * 1000) * 1000ULL);
+  while (released_ticket < ticket)
+  {
+    if (mysql_cond_timedwait(&drained, &mutex, &abstime) &&
+        released_ticket < ticket)
+    {
+      rc= HA_ERR_NO_CONNECTION;
+      break;
+    }
+  }
+  if (!rc && !(line= released_line))
+    rc= HA_ERR_NO_CONNECTION;
+  mysql_mutex_unlock(&mutex);
+  if (!rc)
+    rc= wait_written(line);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Queue a scheduled command, see Ircon_scheduler. Called by the event
+  loop, so it neither waits for room in the queue nor numbers the line.
+  The line goes through the rate limit it was scheduled under, and into
+  the journal like any other queued command.
+*/
+void Ircon_connection::queue_scheduled(const char *line, size_t length,
+                                       ulong rate)
+{
+  if (rate && !admit(rate))
+  {
+    ulonglong ticket;
+    if (defer_line(line, length, rate, &ticket) == HA_ERR_OUT_OF_MEM)
+      my_atomic_add64(&ircon_async_send_errors, 1);
+    return;
+  }
+  mysql_mutex_lock(&mutex);
+  if (breaker_open())
+    my_atomic_add64(&ircon_breaker_rejects, 1);
+  else if (append_output(line, length, 0, NULL, NULL))
+    my_atomic_add64(&ircon_async_send_errors, 1);
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Read "ack:N" lines from the gateway and wake the statements waiting for
+  them. Acks are cumulative: ack N acknowledges every command up to N.
+  Any other line is the answer to the query in flight, if there is one,
+  see query_line(). Event loop only, with mutex held.
+*/
+void Ircon_connection::read_input()
+{
+  mysql_mutex_assert_owner(&mutex);
+  for (;;)
+  {
+    ssize_t got= mysql_socket_recv(socket, ack_buffer + ack_length,
+                                   sizeof(ack_buffer) - ack_length,
+                                   MSG_DONTWAIT);
+    char *line= ack_buffer;
+    char *end;
+    char *newline;
+
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (got <= 0)
+    {
+      disconnect();
+      return;
+    }
+    end= ack_buffer + ack_length + got;
+    while ((newline= (char*) memchr(line, '\n', end - line)))
+    {
+      if (newline - line > 4 && !memcmp(line, "ack:", 4))
+      {
+        ulonglong seq= strtoull(line + 4, NULL, 10);
+        if (seq > acked_seq && seq < next_seq)
+        {
+          /* Commands up to lost_seq were counted as lost already */
+          if (seq > MY_MAX(acked_seq, lost_seq))
+            my_atomic_add64(&ircon_commands_acked,
+                            (int64) (seq - MY_MAX(acked_seq, lost_seq)));
+          acked_seq= seq;
+          mysql_cond_broadcast(&drained);
+        }
+      }
+      else if (querying && query_result < 0)
+      {
+        query_response_length= MY_MIN((size_t) (newline - line),
+                                      sizeof(query_response));
+        memcpy(query_response, line, query_response_length);
+        query_result= 0;
+        mysql_cond_broadcast(&drained);
+      }
+      line= newline + 1;
+    }
+    ack_length= (uint) (end - line);
+    if (ack_length == sizeof(ack_buffer))
+      ack_length= 0;            /* Too long for an ack or answer, drop it */
+    else
+      memmove(ack_buffer, line, ack_length);
+  }
+}
+
+
+/**
+  @brief
+  Give up on the commands still waiting for an ack when the connection is
+  lost, along with the output that was not written. The statements
+  waiting for them fail.
+*/
+void Ircon_connection::lose_unacked()
+{
+  mysql_mutex_assert_owner(&mutex);
+  ack_length= 0;
+  if (next_seq - 1 > MY_MAX(acked_seq, lost_seq))
+  {
+    my_atomic_add64(&ircon_commands_unacked,
+                    (int64) (next_seq - 1 - MY_MAX(acked_seq, lost_seq)));
+    lost_seq= next_seq - 1;
+    drop_output();
+  }
+}
+
+
+/**
+  @brief
+  Wait up to ircon_read_timeout for a pipelined command to be acked.
+
+  @return
+    0 if it was, HA_ERR_NO_CONNECTION if it was lost or timed out.
+*/
+int Ircon_connection::wait_ack(ulonglong seq)
+{
+  struct timespec abstime;
+  int rc= 0;
+  DBUG_ENTER("Ircon_connection::wait_ack");
+  IRCON_STAGE(&ircon_stage_waiting_for_ack);
+
+  set_timespec_nsec(abstime, (ulonglong) srv_read_timeout * 1000000ULL);
+  mysql_mutex_lock(&mutex);
+  while (acked_seq < seq && !rc)
+  {
+    if (lost_seq >= seq)
+      rc= HA_ERR_NO_CONNECTION;
+    else if (mysql_cond_timedwait(&drained, &mutex, &abstime) &&
+             acked_seq < seq)
+    {
+      /* Later acks are as late; resynchronize on a new connection */
+      disconnect();
+      rc= HA_ERR_NO_CONNECTION;
+    }
+  }
+  mysql_mutex_unlock(&mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Wait up to ircon_read_timeout for the event loop to write a queued
+  output line. A device that does not take it in time is disconnected
+  and the output still queued for it dropped, like after a failed write.
+
+  @return
+    0 once it was written, HA_ERR_NO_CONNECTION if it was dropped or
+    timed out.
+*/
+int Ircon_connection::wait_written(ulonglong line)
+{
+  struct timespec abstime;
+  int rc= 0;
+  DBUG_ENTER("Ircon_connection::wait_written");
+  IRCON_STAGE(&ircon_stage_waiting_for_output);
+
+  set_timespec_nsec(abstime, (ulonglong) srv_read_timeout * 1000000ULL);
+  mysql_mutex_lock(&mutex);
+  while (written_seq < line)
+  {
+    if (dropped_seq >= line)
+    {
+      rc= HA_ERR_NO_CONNECTION;
+      break;
+    }
+    if (mysql_cond_timedwait(&drained, &mutex, &abstime) &&
+        written_seq < line)
+    {
+      disconnect();
+      drop_output();
+      rc= HA_ERR_NO_CONNECTION;
+      break;
+    }
+  }
+  mysql_mutex_unlock(&mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  React to epoll events on the socket. Event loop only.
+*/
+void Ircon_connection::handle_events(uint32 ready)
+{
+  mysql_mutex_lock(&mutex);
+  if (state == IRCON_CONNECTION_CONNECTING)
+  {
+    if (finish_connect())
+      drop_output();
+  }
+  else if (state == IRCON_CONNECTION_CONNECTED &&
+           (ready & (EPOLLERR | EPOLLHUP)))
+  {
+    /* The device went away; reconnect if there is something to write */
+    disconnect();
+    if (output_start < output_end && start_connect())
+      drop_output();
+  }
+  if (state == IRCON_CONNECTION_CONNECTED && (ready & EPOLLIN))
+    read_input();
+  if (state == IRCON_CONNECTION_CONNECTED && output_start < output_end)
+    write_output(false);
+  update_events();
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Fail a connect that has taken longer than ircon_connect_timeout, and
+  health check an endpoint whose circuit breaker is open: the breaker is
+  half open while a connect is tried, and closes if it succeeds.
+*/
+void Ircon_connection::check_timeout(ulonglong now)
+{
+  mysql_mutex_lock(&mutex);
+  if (state == IRCON_CONNECTION_CONNECTING && now >= connect_deadline)
+  {
+    connect_failed();
+    drop_output();
+  }
+  else if (breaker == IRCON_BREAKER_OPEN && now >= probe_at &&
+           state != IRCON_CONNECTION_CONNECTING)
+  {
+    breaker= IRCON_BREAKER_HALF_OPEN;
+    my_atomic_add64(&ircon_health_checks, 1);
+    start_connect();
+  }
+  mysql_mutex_unlock(&mutex);
+}
+
+
+bool Ircon_event_loop::init()
+{
+  struct epoll_event event;
+
+  connections= NULL;
+  retired= NULL;
+  wake_fd= -1;
+  if ((epoll_fd= epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return true;
+  if ((wake_fd= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    ::close(epoll_fd);
+    return true;
+  }
+  event.events= EPOLLIN;
+  event.data.ptr= NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event))
+  {
+    ::close(wake_fd);
+    ::close(epoll_fd);
+    return true;
+  }
+  mysql_mutex_init(ircon_key_mutex_Ircon_event_loop_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+  return false;
+}
+
+
+void Ircon_event_loop::destroy()
+{
+  while (retired)
+  {
+    Ircon_connection *connection= retired;
+    retired= connection->next_retired;
+    delete connection;
+  }
+  mysql_mutex_destroy(&mutex);
+  ::close(wake_fd);
+  ::close(epoll_fd);
+}
+
+
+void Ircon_event_loop::wake()
+{
+  uint64 one= 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+  {}  /* The counter is already non-zero, the loop wakes anyway */
+}
+
+
+/**
+  @brief
+  Add a new pooled connection to the ones the loop runs timeouts, health
+  checks and idle expiry for.
+*/
+void Ircon_event_loop::attach(Ircon_connection *connection)
+{
+  mysql_mutex_lock(&mutex);
+  connection->loop_prev= NULL;
+  if ((connection->loop_next= connections))
+    connections->loop_prev= connection;
+  connections= connection;
+  mysql_mutex_unlock(&mutex);
+}
+
+
+/**
+  @brief
+  Take a connection out of the epoll set and the loop's connections, and
+  free it on the next loop iteration, after the events already fetched
+  have been handled.
+*/
+void Ircon_event_loop::retire(Ircon_connection *connection)
+{
+  mysql_mutex_lock(&connection->mutex);
+  connection->disconnect();
+  mysql_mutex_unlock(&connection->mutex);
+
+  mysql_mutex_lock(&mutex);
+  if (connection->loop_prev)
+    connection->loop_prev->loop_next= connection->loop_next;
+  else if (connections == connection)
+    connections= connection->loop_next;
+  if (connection->loop_next)
+    connection->loop_next->loop_prev= connection->loop_prev;
+  connection->loop_next= connection->loop_prev= NULL;
+  connection->next_retired= retired;
+  retired= connection;
+  mysql_mutex_unlock(&mutex);
+  wake();
+}
+
+
+/*
+  Timer wheel of scheduled commands: IRCON_WHEEL_LEVELS levels, the first
+  of 2^IRCON_WHEEL_BITS slots of one IRCON_EVENT_LOOP_TICK each, every
+  further one of 2^IRCON_WHEEL_LEVEL_BITS slots spanning all of the level
+  below. That covers some 77 days; commands due later wait in the last
+  level's farthest slot and are placed anew each time it comes round.
+*/
+#define IRCON_WHEEL_BITS 8
+#define IRCON_WHEEL_LEVEL_BITS 6
+#define IRCON_WHEEL_LEVELS 4
+#define IRCON_WHEEL_SPAN \
+  (1ULL << (IRCON_WHEEL_BITS + \
+            (IRCON_WHEEL_LEVELS - 1) * IRCON_WHEEL_LEVEL_BITS))
+
+/** @brief
+  A scheduled command line, holding a reference to its connection until
+  it is dispatched.
+*/
+struct Ircon_timer
+{
+  Ircon_timer *next;
+  ulonglong expires;       ///< Wheel tick it is due at
+  ulong rate;              ///< Rate limit of the table, see ircon_rate_limit
+  Ircon_connection *connection;
+  size_t length;
+  char *line;
+};
+
+/** @brief
+  Commands written with a future IRCON_COLUMN_SCHEDULE time. They wait in
+  a hierarchical timer wheel, so that adding one and the work per tick do
+  not depend on how many are waiting. The first event loop advances the
+  wheel every tick, and dispatches the commands that came due in batches
+  of at most ircon_schedule_batch per tick, the rest waiting in order for
+  the next ticks: a time shared by many devices does not send all their
+  commands at once.
+*/
+class Ircon_scheduler
+{
+public:
+  void init();
+  void destroy();
+  int add(Ircon_connection *connection, const char *line, size_t length,
+          ulonglong due, ulong rate);
+  void tick(ulonglong now);
+
+private:
+  mysql_mutex_t mutex;
+  Ircon_timer *wheel[IRCON_WHEEL_LEVELS][1 << IRCON_WHEEL_BITS];
+  ulonglong current;       ///< Next wheel tick to expire
+  Ircon_timer *ready;      ///< Due, in the order they came due
+  Ircon_timer **ready_tail;
+
+  void place(Ircon_timer *timer);
+  uint cascade(uint level);
+};
+
+static Ircon_scheduler ircon_scheduler;
+
+
+void Ircon_scheduler::init()
+{
+  mysql_mutex_init(ircon_key_mutex_Ircon_scheduler_mutex, &mutex,
+                   MY_MUTEX_INIT_FAST);
+  memset(wheel, 0, sizeof(wheel));
+  current= my_micro_time() / (IRCON_EVENT_LOOP_TICK * 1000);
+  ready= NULL;
+  ready_tail= &ready;
+}
+
+
+/**
+  @brief
+  Drop the commands still scheduled, once the event loops are stopped.
+*/
+void Ircon_scheduler::destroy()
+{
+  Ircon_timer *list= ready;
+
+  for (uint level= 0; level < IRCON_WHEEL_LEVELS; level++)
+    for (uint slot= 0; slot < (1U << IRCON_WHEEL_BITS); slot++)
+      while (Ircon_timer *timer= wheel[level][slot])
+      {
+        wheel[level][slot]= timer->next;
+        timer->next= list;
+        list= timer;
+      }
+  while (list)
+  {
+    Ircon_timer *timer= list;
+    list= timer->next;
+    ircon_release_connection(timer->connection);
+    my_free(timer);
+  }
+  my_atomic_store64(&ircon_schedule_pending, 0);
+  mysql_mutex_destroy(&mutex);
+}
+
+
+/**
+  @brief
+  Put a timer in the slot of the lowest level that reaches its tick.
+  Must be called with mutex held.
+*/
+void Ircon_scheduler::place(Ircon_timer *timer)
+{
+  ulonglong expires= MY_MAX(timer->expires, current);
+  ulonglong delta;
+  Ircon_timer **slot;
+
+  expires= MY_MIN(expires, current + IRCON_WHEEL_SPAN - 1);
+  delta= expires - current;
+  if (delta < (1ULL << IRCON_WHEEL_BITS))
+    slot= &wheel[0][expires & ((1 << IRCON_WHEEL_BITS) - 1)];
+  else
+  {
+    uint level= 1;
+    while (delta >= (1ULL << (IRCON_WHEEL_BITS +
+                              level * IRCON_WHEEL_LEVEL_BITS)))
+      level++;
+    slot= &wheel[level][(expires >> (IRCON_WHEEL_BITS +
+                                     (level - 1) * IRCON_WHEEL_LEVEL_BITS)) &
+                        ((1 << IRCON_WHEEL_LEVEL_BITS) - 1)];
+  }
+  timer->next= *slot;
+  *slot= timer;
+}
+
+
+/**
+  @brief
+  Spread the slot of a level that the current tick has come round to
+  over the levels below.
+
+  @return
+    The slot, 0 when the level above has to be cascaded too.
+*/
+uint Ircon_scheduler::cascade(uint level)
+{
+  uint index= (uint) (current >> (IRCON_WHEEL_BITS +
+                                  (level - 1) * IRCON_WHEEL_LEVEL_BITS)) &
+              ((1 << IRCON_WHEEL_LEVEL_BITS) - 1);
+  Ircon_timer *list= wheel[level][index];
+
+  wheel[level][index]= NULL;
+  while (list)
+  {
+    Ircon_timer *timer= list;
+    list= timer->next;
+    place(timer);
+  }
+  return index;
+}
+
+
+/**
+  @brief
+  Schedule a command line for a connection at due, in my_micro_time()
+  microseconds, taking a reference to the connection until it is sent.
+
+  @return
+    0, or HA_ERR_OUT_OF_MEM.
+*/
+int Ircon_scheduler::add(Ircon_connection *connection, const char *line,
+                         size_t length, ulonglong due, ulong rate)
+{
+  Ircon_timer *timer;
+  DBUG_ENTER("Ircon_scheduler::add");
+
+  if (!(timer= (Ircon_timer*) my_malloc(ircon_key_memory_command_queue,
+                                        sizeof(Ircon_timer) + length,
+                                        MYF(MY_WME))))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  ircon_retain_connection(connection);
+  timer->connection= connection;
+  timer->rate= rate;
+  timer->line= (char*) (timer + 1);
+  memcpy(timer->line, line, length);
+  timer->length= length;
+  timer->expires= due / (IRCON_EVENT_LOOP_TICK * 1000);
+
+  mysql_mutex_lock(&mutex);
+  place(timer);
+  mysql_mutex_unlock(&mutex);
+  my_atomic_add64(&ircon_commands_scheduled, 1);
+  my_atomic_add64(&ircon_schedule_pending, 1);
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Expire the wheel up to now and dispatch the next batch of due commands.
+  First event loop only.
+*/
+void Ircon_scheduler::tick(ulonglong now)
+{
+  ulonglong target= now / (IRCON_EVENT_LOOP_TICK * 1000);
+  Ircon_timer *batch;
+  ulong count= 0;
+
+  mysql_mutex_lock(&mutex);
+  for (; current <= target; current++)
+  {
+    uint index= (uint) (current & ((1 << IRCON_WHEEL_BITS) - 1));
+    if (!index)
+    {
+      uint level= 1;
+      while (level < IRCON_WHEEL_LEVELS && !cascade(level))
+        level++;
+    }
+    if (wheel[0][index])
+    {
+      Ircon_timer *last= wheel[0][index];
+      while (last->next)
+        last= last->next;
+      *ready_tail= wheel[0][index];
+      ready_tail= &last->next;
+      wheel[0][index]= NULL;
+    }
+  }
+  batch= NULL;
+  for (Ircon_timer **tail= &batch; ready && count < srv_schedule_batch;
+       count++)
+  {
+    *tail= ready;
+    tail= &ready->next;
+    ready= ready->next;
+    *tail= NULL;
+  }
+  if (!ready)
+    ready_tail= &ready;
+  mysql_mutex_unlock(&mutex);
+
+  while (batch)
+  {
+    Ircon_timer *timer= batch;
+    batch= timer->next;
+    timer->connection->queue_scheduled(timer->line, timer->length,
+                                       timer->rate);
+    ircon_release_connection(timer->connection);
+    my_free(timer);
+  }
+  if (count)
+    my_atomic_add64(&ircon_schedule_pending, -(int64) count);
+}
+
+
+/**
+  @brief
+  The loop: write output, complete connects and handle hangups as epoll
+  reports them, and every IRCON_EVENT_LOOP_TICK time out connects, run
+  health checks, release rate limited commands and expire idle
+  connections of its own, and, in the first loop, dispatch scheduled
+  commands. The tick only takes the loop's mutex, not the pool's, so
+  loops do not serialize on each other or on tables opening. On shutdown
+  it goes on until all output is written or one connect timeout has
+  passed.
+*/
+void Ircon_event_loop::run()
+{
+  struct epoll_event ready[64];
+  ulonglong next_tick= 0;
+  ulonglong stop_deadline= 0;
+
+  for (;;)
+  {
+    Ircon_connection *free_list;
+    Ircon_connection *idle[64];
+    uint idle_count= 0;
+    ulonglong now;
+    int count;
+
+    mysql_mutex_lock(&mutex);
+    free_list= retired;
+    retired= NULL;
+    mysql_mutex_unlock(&mutex);
+    while (free_list)
+    {
+      Ircon_connection *connection= free_list;
+      free_list= connection->next_retired;
+      delete connection;
+    }
+
+    now= my_micro_time();
+    if (my_atomic_load32(&ircon_event_loops_stop))
+    {
+      if (!stop_deadline)
+        stop_deadline= now + (ulonglong) srv_connect_timeout * 1000;
+      if (!my_atomic_load64(&ircon_output_depth) || now >= stop_deadline)
+        break;
+    }
+
+    count= epoll_wait(epoll_fd, ready, array_elements(ready),
+                      IRCON_EVENT_LOOP_TICK);
+    for (int i= 0; i < count; i++)
+    {
+      if (!ready[i].data.ptr)
+      {
+        uint64 value;
+        if (read(wake_fd, &value, sizeof(value)) < 0)
+        {}  /* Spurious wakeup */
+        continue;
+      }
+      ((Ircon_connection*) ready[i].data.ptr)->handle_events(ready[i].events);
+    }
+
+    if ((now= my_micro_time()) >= next_tick)
+    {
+      next_tick= now + IRCON_EVENT_LOOP_TICK * 1000;
+      ircon_journal.tick(now);
+      if (this == ircon_event_loops)
+        ircon_scheduler.tick(now);
+      mysql_mutex_lock(&mutex);
+      for (Ircon_connection *connection= connections; connection;
+           connection= connection->loop_next)
+      {
+        connection->check_timeout(now);
+        connection->release_deferred(now);
+        if (idle_count < array_elements(idle) &&
+            ircon_connection_idle(connection, now))
+          idle[idle_count++]= connection;
+      }
+      mysql_mutex_unlock(&mutex);
+      /* Frees through retire(), which takes the loop's mutex */
+      if (idle_count)
+        ircon_expire_idle_connections(idle, idle_count, now);
+    }
+  }
+}
+
+
+static void *ircon_event_loop_thread(void *arg)
+{
+  my_thread_init();
+  ((Ircon_event_loop*) arg)->run();
+  my_thread_end();
+  return NULL;
+}
+
+
+/**
+  @brief
+  Pick the event loop of a new connection, round robin.
+*/
+static Ircon_event_loop *ircon_assign_event_loop()
+{
+  uint32 next= (uint32) my_atomic_add32(&ircon_next_event_loop, 1);
+  return &ircon_event_loops[next % ircon_event_loop_count];
+}
+
+
+/**
+  @brief
+  Stop and join the first count event loops, or, with join false, free
+  them once they are stopped and the pool no longer retires connections
+  to them.
+*/
+static void ircon_stop_event_loops(ulong count, bool join)
+{
+  if (join)
+  {
+    my_atomic_store32(&ircon_event_loops_stop, 1);
+    for (ulong i= 0; i < count; i++)
+    {
+      ircon_event_loops[i].wake();
+      my_thread_join(&ircon_event_loops[i].thread, NULL);
+    }
+    return;
+  }
+  for (ulong i= 0; i < count; i++)
+    ircon_event_loops[i].destroy();
+  my_free(ircon_event_loops);
+  ircon_event_loops= NULL;
+  ircon_event_loop_count= 0;
+}
+
+
+static bool ircon_start_event_loops()
+{
+  ulong started;
+
+  if (!(ircon_event_loops= (Ircon_event_loop*)
+        my_malloc(ircon_key_memory_connections,
+                  srv_event_threads * sizeof(Ircon_event_loop), MYF(MY_WME))))
+    return true;
+  my_atomic_store32(&ircon_event_loops_stop, 0);
+  for (started= 0; started < srv_event_threads; started++)
+  {
+    Ircon_event_loop *loop= &ircon_event_loops[started];
+    if (loop->init())
+      break;
+    if (mysql_thread_create(ircon_key_thread_event_loop, &loop->thread, NULL,
+                            ircon_event_loop_thread, loop))
+    {
+      loop->destroy();
+      break;
+    }
+  }
+  ircon_event_loop_count= started;
+  if (started < srv_event_threads)
+  {
+    ircon_stop_event_loops(started, true);
+    ircon_stop_event_loops(started, false);
+    return true;
+  }
+  return false;
+}
+
+
+/**
+  @brief
+  Send one command and account for the send() calls it saved.
+*/
+static int ircon_send_now(Ircon_connection *connection, const char *line,
+                          size_t length, int unbatched_calls)
+{
+  int calls;
+  int rc= connection->send_line(line, length, &calls);
+
+  if (!rc)
+    my_atomic_add64(&ircon_send_syscalls_saved, unbatched_calls - calls);
+  return rc;
+}
+
+
+/**
+  @brief
+  Send a command line to a device, either right away or, with
+  ircon_durability=async, through the connection's event loop.
+
+  @param unbatched_calls  send() calls the unbatched protocol would have
+                          made, for ircon_send_syscalls_saved.
+  @param written          If set, a synchronous command is queued as well,
+                          to be written in parallel with the commands to
+                          other devices; written is set to the line to
+                          wait for with Ircon_connection::wait_written(),
+                          or to 0 if there is nothing to wait for.
+
+  With ircon_pipeline_window set, commands are numbered and always go
+  through the event loop; seq is set to the number to wait for with
+  Ircon_connection::wait_ack(). Otherwise it is set to 0.
+
+  @return
+    0 on success, HA_ERR_NO_CONNECTION if a synchronous send failed.
+*/
+int ircon_send_command(Ircon_connection *connection, const char *line,
+                       size_t length, int unbatched_calls, ulonglong *seq,
+                       ulonglong *written)
+{
+  DBUG_ENTER("ircon_send_command");
+
+  *seq= 0;
+  if (written)
+    *written= 0;
+  if (srv_pipeline_window)
+    DBUG_RETURN(connection->queue_line(line, length, unbatched_calls, seq,
+                                       NULL));
+  if (srv_durability != IRCON_DURABILITY_ASYNC && written)
+    DBUG_RETURN(connection->queue_line(line, length, unbatched_calls, NULL,
+                                       written));
+
+  /*
+    Commands already queued for the device go first, even after switching
+    back to sync, so that a device never sees its commands reordered.
+  */
+  if (srv_durability != IRCON_DURABILITY_ASYNC &&
+      !my_atomic_load32(&connection->queued))
+    DBUG_RETURN(ircon_send_now(connection, line, length, unbatched_calls));
+  DBUG_RETURN(connection->queue_line(line, length, unbatched_calls, NULL,
+                                     NULL));
+}
+
+
+/**
+  @brief
+  Free the Ircon_statement of a client connection.
+*/
+static int ircon_close_connection(handlerton *hton, THD *thd)
+{
+  delete (Ircon_statement*) thd_get_ha_data(thd, hton);
+  thd_set_ha_data(thd, hton, NULL);
+  return 0;
+}
+
+
+static int ircon_init_func(void *p)
+{
+  DBUG_ENTER("ircon_init_func");
+
+#ifdef HAVE_PSI_INTERFACE
+  init_ircon_psi_keys();
+#endif
+
+  ircon_hton= (handlerton *)p;
+  mysql_mutex_init(ircon_key_mutex_ircon_connections,
+                   &ircon_connections_mutex, MY_MUTEX_INIT_FAST);
+  if (my_hash_init(&ircon_connections, &my_charset_bin, 32, 0, 0,
+                   (my_hash_get_key) ircon_connection_get_key,
+                   (my_hash_free_key) ircon_connection_free, 0,
+                   ircon_key_memory_connections))
+  {
+    mysql_mutex_destroy(&ircon_connections_mutex);
+    DBUG_RETURN(1);
+  }
+
+  if (ircon_resolver.init())
+  {
+    my_hash_free(&ircon_connections);
+    mysql_mutex_destroy(&ircon_connections_mutex);
+    DBUG_RETURN(1);
+  }
+  ircon_scheduler.init();
+  if (ircon_start_event_loops())
+  {
+    ircon_scheduler.destroy();
+    ircon_resolver.destroy();
+    my_hash_free(&ircon_connections);
+    mysql_mutex_destroy(&ircon_connections_mutex);
+    DBUG_RETURN(1);
+  }
+
+  /* Replay needs the event loops, and journals the commands anew */
+  if (srv_journal_file && *srv_journal_file)
+  {
+    if (ircon_journal.open(srv_journal_file, srv_journal_size))
+      sql_print_error("IRCON: cannot open journal file '%s', commands are "
+                      "not journaled", srv_journal_file);
+    else
+      ircon_journal.replay();
+  }
+
+  ircon_connections_ready= true;
+  ircon_hton->state=                     SHOW_OPTION_YES;
+  ircon_hton->create=                    ircon_create_handler;
+  ircon_hton->close_connection=          ircon_close_connection;
+  ircon_hton->flags=                     HTON_CAN_RECREATE;
+  ircon_hton->system_database=   ircon_system_database;
+  ircon_hton->is_supported_system_table= ircon_is_supported_system_table;
+
+  DBUG_RETURN(0);
+}
+
+
+static int ircon_done_func(void *p)
+{
+  DBUG_ENTER("ircon_done_func");
+  ircon_connections_ready= false;
+
+  /* The loops write what is still queued before they exit */
+  ircon_stop_event_loops(ircon_event_loop_count, true);
+  /* Commands scheduled for later are not kept across restarts */
+  ircon_scheduler.destroy();
+  /* What they could not write stays journaled for the next startup */
+  ircon_journal.close();
+  my_hash_free(&ircon_connections);
+  mysql_mutex_destroy(&ircon_connections_mutex);
+  ircon_stop_event_loops(ircon_event_loop_count, false);
+  /* Connects look it up, so it goes once the connections are freed */
+  ircon_resolver.destroy();
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Ircon of simple lock controls. The "share" it creates is a
+  structure we will pass to each ircon handler. Do you have to have
+  one of these? Well, you have pieces that are used for locking, and
+  they are needed to function.
+*/
+
+Ircon_share *ha_ircon::get_share()
+{
+  Ircon_share *tmp_share;
+
+  DBUG_ENTER("ha_ircon::get_share()");
+
+  lock_shared_ha_data();
+  if (!(tmp_share= static_cast<Ircon_share*>(get_ha_share_ptr())))
+  {
+    tmp_share= new Ircon_share;
+    if (!tmp_share)
+      goto err;
+    if (tmp_share->init(table_share))
+    {
+      delete tmp_share;
+      tmp_share= NULL;
+      goto err;
+    }
+
+    set_ha_share_ptr(static_cast<Handler_share*>(tmp_share));
+  }
+err:
+  unlock_shared_ha_data();
+  DBUG_RETURN(tmp_share);
+}
+
+
+static handler* ircon_create_handler(handlerton *hton,
+                                       TABLE_SHARE *table, 
+                                       MEM_ROOT *mem_root)
+{
+  return new (mem_root) ha_ircon(hton, table);
+}
+
+ha_ircon::ha_ircon(handlerton *hton, TABLE_SHARE *table_arg)
+  :handler(hton, table_arg), current_slot(0), current_device(NULL),
+   pending_devices(ircon_key_memory_devices), batch_id(0), bulk_insert(false),
+   error_field(NULL),
+   error_endpoint(NULL),
+   field_commands(NULL), command_fields(NULL), command_field_count(0),
+   pushed_predicates(ircon_key_memory_filter), filter_memo(NULL),
+   filter_memo_size(0), filter_memo_used(0), filter_block(UINT_MAX),
+   filter_mask(0), filter_state(false), scan_start(0)
+{
+  command_line.set(command_line_buffer, sizeof(command_line_buffer),
+                   &my_charset_bin);
+}
+
+
+/**
+  @brief
+  If frm_error() is called then we will use this to determine
+  the file extensions that exist for the storage engine. This is also
+  used by the default rename_table and delete_table method in
+  handler.cc.
+
+  For engines that have two file name extentions (separate meta/index file
+  and data file), the order of elements is relevant. First element of engine
+  file name extentions array should be meta/index file extention. Second
+  element - data file extention. This order is assumed by
+  prepare_for_repair() when REPAIR TABLE ... USE_FRM is issued.
+
+  @see
+  rename_table method in handler.cc and
+  delete_table method in handler.cc
+*/
+
+static const char *ha_ircon_exts[] = {
+  IRCON_STATE_EXT,
+  NullS
+};
+
+const char **ha_ircon::bas_ext() const
+{
+  return ha_ircon_exts;
+}
+
+/*
+  Following handler function provides access to
+  system database specific to SE. This interface
+  is optional, so every SE need not implement it.
+*/
+const char* ha_ircon_system_database= NULL;
+const char* ircon_system_database()
+{
+  return ha_ircon_system_database;
+}
+
+/*
+  List of all system tables specific to the SE.
+  Array element would look like below,
+     { "<database_name>", "<system table name>" },
+  The last element MUST be,
+     { (const char*)NULL, (const char*)NULL }
+
+  This array is optional, so every SE need not implement it.
+*/
+static st_handler_tablename ha_ircon_system_tables[]= {
+  {(const char*)NULL, (const char*)NULL}
+};
+
+/**
+  @brief Check if the given db.tablename is a system table for this SE.
+
+  @param db                         Database name to check.
+  @param table_name                 table name to check.
+  @param is_sql_layer_system_table  if the supplied db.table_name is a SQL
+                                    layer system table.
+
+  @return
+    @retval TRUE   Given db.table_name is supported system table.
+    @retval FALSE  Given db.table_name is not a supported system table.
+*/
+static bool ircon_is_supported_system_table(const char *db,
+                                              const char *table_name,
+                                              bool is_sql_layer_system_table)
+{
+  st_handler_tablename *systab;
+
+  // Does this SE support "ALL" SQL layer system tables ?
+  if (is_sql_layer_system_table)
+    return false;
+
+  // Check if this is SE layer system tables
+  systab= ha_ircon_system_tables;
+  while (systab && systab->db)
+  {
+    if (systab->db == db &&
+        strcmp(systab->tablename, table_name) == 0)
+      return true;
+    systab++;
+  }
+
+  return false;
+}
+
+
+/**
+  @brief
+  Send a query line and return the one line the gateway answers with, up
+  to but not including its newline, waiting ircon_read_timeout for it.
+
+  @details
+  The query goes through the event loop like an asynchronous command, and
+  the loop reads the answer along with the acks, see read_input(). The
+  connection mutex is only held to queue the query and pick up the
+  answer, so commands to the endpoint go on meanwhile. Answers are not
+  numbered, so an endpoint has one query in flight at a time. A query
+  that times out drops the connection and its output, so a late answer
+  cannot be taken as the answer to the next query.
+
+  @return
+    0 on success, IRCON_ERROR_CIRCUIT_OPEN while the circuit breaker is
+    open, HA_ERR_NO_CONNECTION otherwise.
+*/
+int Ircon_connection::query_line(const char *line, size_t length,
+                                 char *response, size_t size,
+                                 size_t *response_length)
+{
+  struct timespec abstime;
+  ulonglong timeout;
+  int rc;
+  DBUG_ENTER("Ircon_connection::query_line");
+  IRCON_STAGE(&ircon_stage_querying);
+
+  mysql_mutex_lock(&mutex);
+  if (breaker_open())
+  {
+    my_atomic_add64(&ircon_breaker_rejects, 1);
+    mysql_mutex_unlock(&mutex);
+    DBUG_RETURN(IRCON_ERROR_CIRCUIT_OPEN);
+  }
+  timeout= (ulonglong) srv_read_timeout * 1000000ULL;
+  if (state != IRCON_CONNECTION_CONNECTED)
+    timeout+= (ulonglong) srv_connect_timeout * 1000000ULL;
+  set_timespec_nsec(abstime, timeout);
+  while (querying)
+  {
+    if (mysql_cond_timedwait(&drained, &mutex, &abstime) && querying)
+    {
+      mysql_mutex_unlock(&mutex);
+      DBUG_RETURN(HA_ERR_NO_CONNECTION);
+    }
+  }
+  querying= true;
+  query_result= -1;
+  if ((rc= append_output(line, length, 1, NULL, NULL, false)))
+    goto end;
+  while (query_result < 0)
+  {
+    if (mysql_cond_timedwait(&drained, &mutex, &abstime) && query_result < 0)
+    {
+      disconnect();
+      drop_output();
+    }
+  }
+  if (!(rc= query_result))
+  {
+    *response_length= MY_MIN(query_response_length, size);
+    memcpy(response, query_response, *response_length);
+  }
+end:
+  querying= false;
+  update_events();
+  mysql_cond_broadcast(&drained);
+  mysql_mutex_unlock(&mutex);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Return the command with exactly the given name, or IRCON_COMMAND_ID_NONE.
+*/
+static enum ircon_command ircon_command_by_name(const char *name,
+                                                size_t length)
+{
+  static const struct
+  {
+    const char *name;
+    size_t length;
+    enum ircon_command command;
+  } commands[]=
+  {
+    {STRING_WITH_LEN(IRCON_COMMAND_MODE), IRCON_COMMAND_ID_MODE},
+    {STRING_WITH_LEN(IRCON_COMMAND_TEMPERATURE), IRCON_COMMAND_ID_TEMPERATURE},
+    {STRING_WITH_LEN(IRCON_COMMAND_POWER), IRCON_COMMAND_ID_POWER},
+    {STRING_WITH_LEN(IRCON_COMMAND_ANGLE), IRCON_COMMAND_ID_ANGLE}
+  };
+
+  for (uint i= 0; i < array_elements(commands); i++)
+    if (commands[i].length == length && !memcmp(commands[i].name, name, length))
+      return commands[i].command;
+  return IRCON_COMMAND_ID_NONE;
+}
+
+/**
+  @brief
+  Return the device command a column name binds it to, or
+  IRCON_COMMAND_ID_NONE for columns that are not device commands.
+*/
+static enum ircon_command ircon_field_command(const char *field_name)
+{
+  if (strncmp(field_name, IRCON_COMMAND_MODE, strlen(field_name)) == 0)
+    return IRCON_COMMAND_ID_MODE;
+  if (strncmp(field_name, IRCON_COMMAND_TEMPERATURE, strlen(field_name)) == 0)
+    return IRCON_COMMAND_ID_TEMPERATURE;
+  if (strncmp(field_name, IRCON_COMMAND_POWER, strlen(field_name)) == 0)
+    return IRCON_COMMAND_ID_POWER;
+  if (strncmp(field_name, IRCON_COMMAND_ANGLE, strlen(field_name)) == 0)
+    return IRCON_COMMAND_ID_ANGLE;
+  return IRCON_COMMAND_ID_NONE;
+}
+
+
+/**
+  @brief
+  Used for opening tables. The name will be the name of the file.
+
+  @details
+  A table is opened when it needs to be opened; e.g. when a request comes in
+  for a SELECT on the table (tables are not open and closed for each request,
+  they are cached).
+
+  Called from handler.cc by handler::ha_open(). The server opens all tables by
+  calling ha_open() which then calls the handler specific open().
+
+  @see
+  handler::ha_open() in handler.cc
+*/
+
+int ha_ircon::open(const char *name, int mode, uint test_if_locked)
+{
+  ulonglong start= ircon_profile_start();
+  DBUG_ENTER("ha_ircon::open");
+
+  if (!(share = get_share()))
+    DBUG_RETURN(1);
+  thr_lock_data_init(&share->lock,&lock,NULL);
+  /* Device slot and id, see position() */
+  ref_length= sizeof(uint32) + sizeof(ulonglong);
+
+  /*
+    Resolve the command of every column once, so that the row paths index
+    field_commands instead of comparing column names.
+  */
+  if (!(command_fields= (uint*) my_malloc(ircon_key_memory_field_commands,
+                                          table->s->fields *
+                                          (sizeof(uint) + sizeof(uchar)),
+                                          MYF(MY_WME))))
+    DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+  field_commands= (uchar*) (command_fields + table->s->fields);
+  command_field_count= 0;
+  for (uint i= 0; i < table->s->fields; i++)
+  {
+    enum ircon_command command= ircon_field_command(table->field[i]->field_name);
+    if (share->multi_device && i == share->device_field)
+      command= IRCON_COMMAND_ID_NONE;
+    field_commands[i]= (uchar) command;
+    if (command != IRCON_COMMAND_ID_NONE)
+      command_fields[command_field_count++]= i;
+  }
+
+  ircon_profile_end(IRCON_OPERATION_OPEN, start);
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Closes a table.
+
+  @details
+  Called from sql_base.cc, sql_select.cc, and table.cc. In sql_select.cc it is
+  only used to close up temporary tables or during the process where a
+  temporary table is converted over to being a myisam table.
+
+  For sql_base.cc look at close_data_tables().
+
+  @see
+  sql_base.cc, sql_select.cc and table.cc
+*/
+
+int ha_ircon::close(void)
+{
+  ulonglong start= ircon_profile_start();
+  DBUG_ENTER("ha_ircon::close");
+
+  my_free(command_fields);
+  command_fields= NULL;
+  field_commands= NULL;
+  cond_pop();
+  my_free(filter_memo);
+  filter_memo= NULL;
+  filter_memo_size= 0;
+  ircon_profile_end(IRCON_OPERATION_CLOSE, start);
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  write_row() inserts a row. No extra() hint is given currently if a bulk load
+  is happening. buf() is a byte array of data. You can use the field
+  information to extract the data from the native byte array type.
+
+  @details
+  Ircon of this would be:
+  @code
+  for (Field **field=table->field ; *field ; field++)
+  {
+    ...
+  }
+  @endcode
+
+  See ha_tina.cc for an ircon of extracting all of the data as strings.
+  ha_berekly.cc has an ircon of how to store it intact by "packing" it
+  for ha_berkeley's own native storage type.
+
+  See the note for update_row() on auto_increments. This case also applies to
+  write_row().
+
+  Called from item_sum.cc, item_sum.cc, sql_acl.cc, sql_insert.cc,
+  sql_insert.cc, sql_select.cc, sql_table.cc, sql_udf.cc, and sql_update.cc.
+
+  @see
+  item_sum.cc, item_sum.cc, sql_acl.cc, sql_insert.cc,
+  sql_insert.cc, sql_select.cc, sql_table.cc, sql_udf.cc and sql_update.cc
+*/
+int ha_ircon::init_writer(const char *ip) {
+  DBUG_ENTER("ha_ircon::init_writer");
+  DBUG_RETURN(0);
+}
+
+/**
+  @brief
+  Write all of a line to the socket. The caller holds mutex and the
+  connection is connected; it is disconnected on error.
+
+  @return
+    0 on success, HA_ERR_NO_CONNECTION otherwise.
+*/
+int Ircon_connection::send_all(const char *line, size_t length, int *calls)
+{
+  mysql_mutex_assert_owner(&mutex);
+  while (length > 0)
+  {
+    ssize_t sent= mysql_socket_send(socket, line, length, 0);
+    (*calls)++;
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      disconnect();
+      return HA_ERR_NO_CONNECTION;
+    }
+    line+= sent;
+    length-= sent;
+  }
+  return 0;
+}
+
+/**
+  @brief
+  Send a whole command line, retrying on short writes and connecting to
+  the device first if needed. A failed send drops the connection so that
+  the next command reconnects.
+
+  @param calls  If not NULL, set to the number of send() calls made.
+
+  @return
+    0 on success, HA_ERR_NO_CONNECTION otherwise.
+*/
+int Ircon_connection::send_line(const char *line, size_t length, int *calls)
+{
+  int rc;
+  int count= 0;
+  ulonglong start, now;
+  uint bucket;
+  DBUG_ENTER("Ircon_connection::send_line");
+  IRCON_STAGE(&ircon_stage_sending);
+
+  mysql_mutex_lock(&mutex);
+  start= my_micro_time();
+  last_command_length= (uint) MY_MIN(length, sizeof(last_command));
+  memcpy(last_command, line, last_command_length);
+  rc= connect_device();
+  /* Output the event loop has not written yet goes first */
+  if (!rc && output_start < output_end)
+    write_output(true);
+  if (!rc && state != IRCON_CONNECTION_CONNECTED)
+    rc= HA_ERR_NO_CONNECTION;
+  if (!rc)
+    rc= send_all(line, length, &count);
+  now= my_micro_time();
+  bucket= ircon_latency_bucket(now - start);
+  latency[bucket]++;
+  my_atomic_add64(&ircon_send_latency[bucket], 1);
+  if (!rc)
+    account_sent(1, length, now);
+  mysql_mutex_unlock(&mutex);
+  if (calls)
+    *calls= count;
+  DBUG_RETURN(rc);
+}
+
+/**
+  @brief
+  The wire format of a table: its wire_format COMMENT, or ircon_wire_format.
+*/
+static ulong ircon_wire_format(const Ircon_share *share)
+{
+  return share->wire_format >= 0 ? (ulong) share->wire_format :
+                                   srv_wire_format;
+}
+
+/**
+  @brief
+  The rate limit of a table: its COMMENT's or else ircon_rate_limit.
+*/
+static ulong ircon_rate_limit(const Ircon_share *share)
+{
+  return share->rate_limit >= 0 ?
+         MY_MIN((ulong) share->rate_limit, 1000000UL) : srv_rate_limit;
+}
+
+/**
+  @brief
+  Build in command_line the line or frame for the current state of the
+  commands of a device set in the commands bitmap.
+
+  @return
+    The number of commands in it.
+*/
+int ha_ircon::build_command(Ircon_device *device, uint commands)
+{
+  char value[IRCON_VALUE_LENGTH + 1];
+  enum ircon_command command;
+  ulong wire_format;
+  int columns= 0;
+
+  wire_format= ircon_wire_format(share);
+  command_line.length(0);
+  if (wire_format == IRCON_WIRE_FORMAT_BINARY)
+  {
+    command_line.append((char) IRCON_FRAME_MAGIC);
+    command_line.append('\0');
+  }
+  for (uint i= 0; i < command_field_count; i++) {
+    Field *field= table->field[command_fields[i]];
+    command= (enum ircon_command) field_commands[command_fields[i]];
+    if (!(commands & (1U << command)))
+      continue;
+    if (wire_format == IRCON_WIRE_FORMAT_BINARY)
+    {
+      command_line.append((char) command);
+      command_line.append(value, share->state.encode(device->slot, command,
+                                                     (uchar*) value));
+    }
+    else
+    {
+      command_line.append(field->field_name);
+      command_line.append(':');
+      command_line.append(value, share->state.get(device->slot, command,
+                                                  value));
+      command_line.append(',');
+    }
+    columns++;
+  }
+  if (wire_format == IRCON_WIRE_FORMAT_BINARY)
+    command_line[1]= (char) (command_line.length() - IRCON_FRAME_HEADER_LENGTH);
+  else
+    command_line.append('\n');
+  return columns;
+}
+
+
+/**
+  @brief
+  Build the command line for the current state of a device and send it in
+  one call. Only the commands set in the commands bitmap are sent, unless
+  the endpoint's rate limit holds the command back: then the line carries
+  every known command of the device, as it replaces any line deferred
+  before it. The commands count as sent, for ircon_dedup_ttl, only once
+  they are queued.
+
+  @param fan_out  Queue a synchronous command for the event loop and wait
+                  for it at the end of the statement, see
+                  ha_ircon::send_command().
+*/
+int ha_ircon::flush_command(Ircon_device *device, uint commands,
+                            bool fan_out) {
+  ulong rate;
+  bool deferred;
+  int columns;
+  time_t now;
+  int rc;
+  DBUG_ENTER("ha_ircon::flush_command");
+
+  if (!commands)
+    DBUG_RETURN(0);
+  rate= ircon_rate_limit(share);
+  if ((deferred= rate && !device->connection->admit(rate)))
+  {
+    for (uint i= 0; i < IRCON_COMMAND_ID_NONE; i++)
+      if (share->state.known(device->slot, (enum ircon_command) i))
+        commands|= 1U << i;
+  }
+  columns= build_command(device, commands);
+
+  if (deferred)
+    DBUG_RETURN(defer_command(device->connection, command_line.ptr(),
+                              command_line.length(), rate));
+  /* The unbatched protocol made 4 send() calls per column plus 1 for "\n" */
+  if ((rc= send_command(device->connection, command_line.ptr(),
+                        command_line.length(), 4 * columns + 1, fan_out)))
+    DBUG_RETURN(rc);
+  now= my_time(0);
+  for (uint i= 0; i < IRCON_COMMAND_ID_NONE; i++)
+    if (commands & (1U << i))
+      device->sent_at[i]= now;
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Build the command line for the current state of a device and hand it to
+  Ircon_scheduler to send at due, in my_micro_time() microseconds.
+
+  The state was assigned by the caller already, so reads show the
+  scheduled values before the command is sent: the table keeps one state
+  per device, the one it was last told to be in.
+*/
+int ha_ircon::schedule_command(Ircon_device *device, uint commands,
+                               ulonglong due)
+{
+  DBUG_ENTER("ha_ircon::schedule_command");
+
+  if (!commands)
+    DBUG_RETURN(0);
+  build_command(device, commands);
+  DBUG_RETURN(ircon_scheduler.add(device->connection, command_line.ptr(),
+                                  command_line.length(), due,
+                                  ircon_rate_limit(share)));
+}
+
+Ircon_statement::Ircon_statement()
+  :tables_locked(0), pending_acks(ircon_key_memory_devices)
+{
+}
+
+
+Ircon_statement::~Ircon_statement()
+{
+  for (size_t i= 0; i < pending_acks.size(); i++)
+    ircon_release_connection(pending_acks[i].connection);
+}
+
+
+/**
+  @brief
+  Remember the last command queued to a connection, or the last line
+  deferred by its rate limit, taking a reference to the connection until
+  wait().
+*/
+int Ircon_statement::add(Ircon_connection *connection, ulonglong seq,
+                         ulonglong written, ulonglong deferred)
+{
+  Ircon_pending_ack pending;
+
+  for (size_t i= 0; i < pending_acks.size(); i++)
+    if (pending_acks[i].connection == connection)
+    {
+      if (seq || written)
+      {
+        pending_acks[i].seq= seq;
+        pending_acks[i].written= written;
+      }
+      if (deferred)
+        pending_acks[i].deferred= deferred;
+      return 0;
+    }
+  pending.connection= connection;
+  pending.seq= seq;
+  pending.written= written;
+  pending.deferred= deferred;
+  if (pending_acks.push_back(pending))
+    return HA_ERR_OUT_OF_MEM;
+  ircon_retain_connection(connection);
+  return 0;
+}
+
+
+/**
+  @brief
+  Wait for the last command queued to each connection. Output is written
+  in order and acks are cumulative, so that covers all of the statement's
+  commands. While this waits for one connection, the event loops go on
+  writing to the others.
+
+  @return
+    0, or HA_ERR_NO_CONNECTION if a command was lost or not acked in time.
+*/
+int Ircon_statement::wait()
+{
+  int rc= 0;
+  int error;
+  DBUG_ENTER("Ircon_statement::wait");
+
+  for (size_t i= 0; i < pending_acks.size(); i++)
+  {
+    Ircon_pending_ack *pending= &pending_acks[i];
+    error= 0;
+    if (pending->deferred)
+      error= pending->connection->wait_deferred(pending->deferred);
+    if (!error && pending->seq)
+      error= pending->connection->wait_ack(pending->seq);
+    else if (!error && pending->written)
+      error= pending->connection->wait_written(pending->written);
+    if (error && !rc)
+      rc= error;
+    ircon_release_connection(pending->connection);
+  }
+  pending_acks.clear();
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Send a command line. A synchronous command the statement has to wait for
+  is handed to the statement's Ircon_statement and waited for when its
+  last IRCON table is unlocked; with fan_out that includes commands that
+  would otherwise be sent right away, so that the commands of a flush go
+  out to all their devices at once.
+*/
+int ha_ircon::send_command(Ircon_connection *connection, const char *line,
+                           size_t length, int unbatched_calls, bool fan_out)
+{
+  Ircon_statement *statement=
+    (Ircon_statement*) thd_get_ha_data(ha_thd(), ht);
+  ulonglong seq;
+  ulonglong written;
+  int rc;
+
+  rc= ircon_send_command(connection, line, length, unbatched_calls, &seq,
+                         fan_out ? &written : NULL);
+  if (rc == IRCON_ERROR_CIRCUIT_OPEN)
+    error_endpoint= connection->endpoint;
+  if (rc || srv_durability == IRCON_DURABILITY_ASYNC ||
+      (!seq && !(fan_out && written)))
+    return rc;
+  if (!fan_out)
+    written= 0;
+  if (statement && statement->tables_locked)
+    return statement->add(connection, seq, written);
+  /* Not within external_lock(), wait right away */
+  return seq ? connection->wait_ack(seq) : connection->wait_written(written);
+}
+
+
+/**
+  @brief
+  Hand a line the rate limit held back to the connection's event loop. A
+  synchronous command waits, like one sent by send_command(), until the
+  line got its token and was written, or fails if it was dropped.
+*/
+int ha_ircon::defer_command(Ircon_connection *connection, const char *line,
+                            size_t length, ulong rate)
+{
+  Ircon_statement *statement=
+    (Ircon_statement*) thd_get_ha_data(ha_thd(), ht);
+  ulonglong ticket= 0;
+  int rc;
+
+  if ((rc= connection->defer_line(line, length, rate, &ticket)))
+  {
+    if (rc == IRCON_ERROR_CIRCUIT_OPEN)
+      error_endpoint= connection->endpoint;
+    return rc;
+  }
+  if (srv_durability == IRCON_DURABILITY_ASYNC || !ticket)
+    return 0;
+  if (statement && statement->tables_locked)
+    return statement->add(connection, 0, 0, ticket);
+  return connection->wait_deferred(ticket);
+}
+
+/**
+  @brief
+  Send what the statement batched. When unlock is set the table is
+  unlocked, and the last IRCON table of the statement to be unlocked waits
+  for the commands of all of them.
+*/
+int ha_ircon::end_statement(bool unlock)
+{
+  Ircon_statement *statement=
+    (Ircon_statement*) thd_get_ha_data(ha_thd(), ht);
+  int rc= 0;
+  int error;
+  DBUG_ENTER("ha_ircon::end_statement");
+
+  if (pending_devices.size())
+    rc= flush_pending();
+  if (!statement || !statement->tables_locked)
+    DBUG_RETURN(rc);
+  if (unlock && --statement->tables_locked)
+    DBUG_RETURN(rc);
+  if ((error= statement->wait()) && !rc)
+    rc= error;
+  DBUG_RETURN(rc);
+}
+
+/**
+  @brief
+  Send the batched state of every device queued since the last flush.
+  Devices deleted, reset or taken over by another statement's batch in the
+  meantime are skipped.
+
+  @return
+    0, or the error of the first command that could not be sent.
+*/
+int ha_ircon::flush_pending(void)
+{
+  int rc= 0;
+  int error;
+  DBUG_ENTER("ha_ircon::flush_pending");
+
+  for (size_t i= 0; i < pending_devices.size(); i++)
+  {
+    Ircon_pending_device *pending= &pending_devices[i];
+    Ircon_device *device;
+
+    if (pending->slot >= share->device_slots ||
+        !(device= share->devices[pending->slot]) ||
+        device->id != pending->id)
+      continue;
+    mysql_mutex_lock(&device->mutex);
+    /* Not taken over by another statement's batch in the meantime */
+    if (device->batch_id == batch_id)
+    {
+      device->batch_id= 0;
+      if ((error= flush_command(device, device->batch_commands, true)) && !rc)
+        rc= error;
+    }
+    mysql_mutex_unlock(&device->mutex);
+  }
+  pending_devices.clear();
+  batch_id= 0;
+  DBUG_RETURN(rc);
+}
+
+/**
+  @brief
+  Parse the commands of the row in record[0]. Callers do this before they
+  add or move a device, so that an invalid row changes nothing: an
+  invalid value fails with IRCON_ERROR_INVALID_VALUE, a new mode or angle
+  value the table has no dictionary code left for with
+  IRCON_ERROR_DICTIONARY_FULL.
+
+  Only the columns in write_set are sent. For an UPDATE, old_data is the
+  row as read and columns whose value did not change are skipped too, so
+  a device does not retransmit a setting it already has.
+*/
+int ha_ircon::parse_row(const uchar *old_data, Ircon_row_commands *row)
+{
+  char attribute_buffer[1024];
+  String attribute(attribute_buffer, sizeof(attribute_buffer), &my_charset_bin);
+  uint commands= 0;
+  enum ircon_command command;
+  ulonglong due= 0;
+  int rc;
+  my_ptrdiff_t offset= old_data ? (my_ptrdiff_t) (old_data - table->record[0]) : 0;
+  my_bitmap_map *org_bitmap = tmp_use_all_columns(table, table->read_set);
+
+  /* A row written with a future send_at has its commands scheduled */
+  if (share->schedule_field >= 0 &&
+      bitmap_is_set(table->write_set, share->schedule_field))
+  {
+    Field *field= table->field[share->schedule_field];
+    struct timeval tv;
+    int warnings= 0;
+    if (!field->is_null() && !field->get_timestamp(&tv, &warnings))
+      due= (ulonglong) tv.tv_sec * 1000000ULL + (ulonglong) tv.tv_usec;
+    if (due <= my_micro_time())
+      due= 0;
+  }
+  for (uint i= 0; i < command_field_count; i++) {
+    Field *field= table->field[command_fields[i]];
+    command= (enum ircon_command) field_commands[command_fields[i]];
+    if (!bitmap_is_set(table->write_set, command_fields[i]))
+      continue;
+    /*
+      The old value is only in the record if the column was read. A
+      scheduled row sends every column written, whatever the device has
+      until then.
+    */
+    if (old_data && !due && bitmap_is_set(table->read_set, command_fields[i]) &&
+        field->is_null() == field->is_null(offset) &&
+        !field->cmp_binary_offset((uint) offset))
+      continue;
+    field->val_str(&attribute, &attribute);
+    if (attribute.length() == 0)
+      continue;
+    if ((rc= share->state.parse(command, attribute.ptr(), attribute.length(),
+                                &row->codes[command])))
+    {
+      tmp_restore_column_map(table->read_set, org_bitmap);
+      error_field= field->field_name;
+      return rc;
+    }
+    commands|= 1U << command;
+  }
+  tmp_restore_column_map(table->read_set, org_bitmap);
+  row->commands= commands;
+  row->due= due;
+  return 0;
+}
+
+
+/**
+  @brief
+  Copy the commands parse_row() got from a row into the device state and
+  send them, or, when ircon_batch_commands is set or in a bulk insert,
+  leave them pending until the statement ends.
+  Every row of a batch overwrites the same device state, so only the last
+  one for each device is sent.
+*/
+int ha_ircon::write_update_row(Ircon_device *device,
+                               const Ircon_row_commands *row)
+{
+  const int *codes= row->codes;
+  uint commands= row->commands;
+  ulonglong due= row->due;
+  ulong ttl;
+  int rc= 0;
+
+  /*
+    The device's mutex keeps the state and the commands sent in the same
+    order when statements write the device concurrently. A device an
+    UPDATE moved to a new key is no longer in its slot.
+  */
+  mysql_mutex_lock(&device->mutex);
+  if (share->devices[device->slot] != device)
+  {
+    mysql_mutex_unlock(&device->mutex);
+    return HA_ERR_KEY_NOT_FOUND;
+  }
+
+  /*
+    With dedup on, a value the device was sent less than the TTL ago is
+    not sent again. The TTL still refreshes it now and then, in case the
+    device was changed by its own remote.
+  */
+  ttl= share->dedup_ttl >= 0 ? (ulong) share->dedup_ttl : srv_dedup_ttl;
+  if (ttl && commands && !due)
+  {
+    time_t now= my_time(0);
+    for (int i= 0; i < IRCON_COMMAND_ID_NONE; i++)
+    {
+      if ((commands & (1U << i)) && device->sent_at[i] &&
+          now - device->sent_at[i] < (time_t) ttl &&
+          share->state.code(device->slot, (enum ircon_command) i) == codes[i])
+      {
+        commands&= ~(1U << i);
+        my_atomic_add64(&ircon_commands_suppressed, 1);
+      }
+    }
+  }
+
+  if (!commands)
+    goto end;
+  mysql_rwlock_rdlock(&share->state_lock);
+  for (int i= 0; i < IRCON_COMMAND_ID_NONE; i++)
+    if (commands & (1U << i))
+      share->state.assign(device->slot, (enum ircon_command) i, codes[i]);
+  mysql_rwlock_unlock(&share->state_lock);
+  share->save_state(device);
+
+  if (due)
+  {
+    rc= schedule_command(device, commands, due);
+    goto end;
+  }
+  if (bulk_insert || THDVAR(ha_thd(), batch_commands))
+  {
+    Ircon_pending_device pending;
+
+    if (!batch_id)
+      batch_id= my_atomic_add64(&ircon_next_batch_id, 1) + 1;
+    if (device->batch_id == batch_id)
+    {
+      device->batch_commands|= commands;
+      my_atomic_add64(&ircon_batch_commands_collapsed, 1);
+      goto end;
+    }
+    pending.slot= device->slot;
+    pending.id= device->id;
+    if (pending_devices.push_back(pending))
+    {
+      rc= HA_ERR_OUT_OF_MEM;
+      goto end;
+    }
+    /*
+      A device still queued in another statement's batch moves to this
+      one, which sends its commands too.
+    */
+    if (device->batch_id)
+      device->batch_commands|= commands;
+    else
+      device->batch_commands= commands;
+    device->batch_id= batch_id;
+    goto end;
+  }
+  rc= flush_command(device, commands, false);
+end:
+  mysql_mutex_unlock(&device->mutex);
+  return rc;
+}
+
+/**
+  @brief
+  Read the device key of a row in record format.
+*/
+void ha_ircon::device_key(const uchar *record, String *key)
+{
+  Field *field= table->field[share->device_field];
+  my_ptrdiff_t offset= (my_ptrdiff_t) (record - table->record[0]);
+  my_bitmap_map *org_bitmap= tmp_use_all_columns(table, table->read_set);
+
+  field->move_field_offset(offset);
+  field->val_str(key, key);
+  field->move_field_offset(-offset);
+  tmp_restore_column_map(table->read_set, org_bitmap);
+}
+
+/**
+  @brief
+  Return the device a row in record format belongs to, or NULL.
+*/
+Ircon_device *ha_ircon::find_device(const uchar *record)
+{
+  char key_buffer[IRCON_MAX_KEY_LENGTH];
+  String key(key_buffer, sizeof(key_buffer), &my_charset_bin);
+
+  if (!share->multi_device)
+    return share->devices[0];
+  device_key(record, &key);
+  return share->find_device(key.ptr(), (uint) key.length());
+}
+
+int ha_ircon::write_row(uchar *buf)
+{
+  char key_buffer[IRCON_MAX_KEY_LENGTH];
+  String key(key_buffer, sizeof(key_buffer), &my_charset_bin);
+  Ircon_device *device;
+  Ircon_row_commands row;
+  ulonglong start= ircon_profile_start();
+  int rc;
+  DBUG_ENTER("ha_ircon::write_row");
+
+  /* An invalid row must not leave its key behind */
+  if ((rc= parse_row(NULL, &row)))
+    DBUG_RETURN(rc);
+  if (!share->multi_device)
+    device= share->devices[0];
+  else
+  {
+    device_key(buf, &key);
+    if ((rc= share->add_device(key.ptr(), (uint) key.length(), &device)))
+    {
+      if (rc == HA_ERR_FOUND_DUPP_KEY)
+        errkey= table_share->primary_key;
+      DBUG_RETURN(rc);
+    }
+  }
+  if ((rc= write_update_row(device, &row)))
+    DBUG_RETURN(rc);
+  /* A large bulk insert sends in chunks, waited for at the end still */
+  if (bulk_insert && pending_devices.size() >= srv_bulk_flush_devices)
+    rc= flush_pending();
+  ircon_profile_end(IRCON_OPERATION_WRITE, start);
+  DBUG_RETURN(rc);
+}
+
+
+/**
+  @brief
+  Yes, update_row() does what you expect, it updates a row. old_data will have
+  the previous row record in it, while new_data will have the newest data in it.
+  Keep in mind that the server can do updates based on ordering if an ORDER BY
+  clause was used. Consecutive ordering is not guaranteed.
+
+  @details
+  Currently new_data will not have an updated auto_increament record. You can
+  do this for ircon by doing:
+
+  @code
+
+  if (table->next_number_field && record == table->record[0])
+    update_auto_increment();
+
+  @endcode
+
+  Changing the device key of a row in a multi-device table moves the state
+  to the new device, and sends it the columns written; nothing is sent to
+  the old one.
+
+  Called from sql_select.cc, sql_acl.cc, sql_update.cc, and sql_insert.cc.
+
+  @see
+  sql_select.cc, sql_acl.cc, sql_update.cc and sql_insert.cc
+*/
+int ha_ircon::update_row(const uchar *old_data, uchar *new_data)
 {
-  return new (mem_root) ha_ircon(hton, table);
-}
+  char key_buffer[IRCON_MAX_KEY_LENGTH];
+  String key(key_buffer, sizeof(key_buffer), &my_charset_bin);
+  Ircon_device *device;
+  Ircon_row_commands row;
+  ulonglong start= ircon_profile_start();
+  bool moved= false;
+  int rc;
+  DBUG_ENTER("ha_ircon::update_row");
 
-ha_ircon::ha_ircon(handlerton *hton, TABLE_SHARE *table_arg)
-  :handler(hton, table_arg)
-{}
+  if (!(device= find_device(old_data)))
+    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+  if (share->multi_device)
+  {
+    device_key(new_data, &key);
+    moved= key.length() != device->name_length ||
+           memcmp(key.ptr(), device->name, key.length());
+  }
+  /* The new device has not been sent anything, every written column is */
+  if ((rc= parse_row(moved ? NULL : old_data, &row)))
+    DBUG_RETURN(rc);
+  if (moved)
+  {
+    Ircon_device *old_device= device;
+
+    if ((rc= share->add_device(key.ptr(), (uint) key.length(), &device)))
+    {
+      if (rc == HA_ERR_FOUND_DUPP_KEY)
+        errkey= table_share->primary_key;
+      DBUG_RETURN(rc);
+    }
+    /* Another statement may still hold the old device, see retire_device() */
+    mysql_mutex_lock(&old_device->mutex);
+    mysql_mutex_lock(&device->mutex);
+    mysql_rwlock_rdlock(&share->state_lock);
+    for (int i= 0; i < IRCON_COMMAND_ID_NONE; i++)
+      share->state.assign(device->slot, (enum ircon_command) i,
+                          share->state.code(old_device->slot,
+                                            (enum ircon_command) i));
+    mysql_rwlock_unlock(&share->state_lock);
+    share->save_state(device);
+    mysql_mutex_unlock(&device->mutex);
+    share->retire_device(old_device);
+    mysql_mutex_unlock(&old_device->mutex);
+  }
+  rc= write_update_row(device, &row);
+  ircon_profile_end(IRCON_OPERATION_WRITE, start);
+  DBUG_RETURN(rc);
+}
 
 
 /**
   @brief
-  If frm_error() is called then we will use this to determine
-  the file extensions that exist for the storage engine. This is also
-  used by the default rename_table and delete_table method in
-  handler.cc.
+  This will delete a row. buf will contain a copy of the row to be deleted.
+  The server will call this right after the current row has been called (from
+  either a previous rnd_nexT() or index call).
 
-  For engines that have two file name extentions (separate meta/index file
-  and data file), the order of elements is relevant. First element of engine
-  file name extentions array should be meta/index file extention. Second
-  element - data file extention. This order is assumed by
-  prepare_for_repair() when REPAIR TABLE ... USE_FRM is issued.
+  @details
+  If you keep a pointer to the last row or can access a primary key it will
+  make doing the deletion quite a bit easier. Keep in mind that the server does
+  not guarantee consecutive deletions. ORDER BY clauses can be used.
+
+  The device is reset with "mode:-". A single-device table keeps its row
+  with unknown state; a multi-device table forgets the device.
+
+  Called in sql_acl.cc and sql_udf.cc to manage internal table
+  information.  Called in sql_delete.cc, sql_insert.cc, and
+  sql_select.cc. In sql_select it is used for removing duplicates
+  while in insert it is used for REPLACE calls.
 
   @see
-  rename_table method in handler.cc and
-  delete_table method in handler.cc
+  sql_acl.cc, sql_udf.cc, sql_delete.cc, sql_insert.cc and sql_select.cc
 */
 
-static const char *ha_ircon_exts[] = {
-  NullS
-};
-
-const char **ha_ircon::bas_ext() const
+int ha_ircon::delete_row(const uchar *buf)
 {
-  return ha_ircon_exts;
-}
+  Ircon_device *device;
+  int rc;
+  DBUG_ENTER("ha_ircon::delete_row");
 
-/*
-  Following handler function provides access to
-  system database specific to SE. This interface
-  is optional, so every SE need not implement it.
-*/
-const char* ha_ircon_system_database= NULL;
-const char* ircon_system_database()
-{
-  return ha_ircon_system_database;
+  if (!(device= find_device(buf)))
+    DBUG_RETURN(HA_ERR_KEY_NOT_FOUND);
+  mysql_mutex_lock(&device->mutex);
+  mysql_rwlock_rdlock(&share->state_lock);
+  share->state.reset(device->slot);
+  mysql_rwlock_unlock(&share->state_lock);
+  memset(device->sent_at, 0, sizeof(device->sent_at));
+  /* A queued command for the device is superseded by the reset */
+  device->batch_id= 0;
+  {
+    static const char frame[]=
+    {
+      (char) IRCON_FRAME_MAGIC, 3, IRCON_COMMAND_ID_MODE, 1, '-'
+    };
+    bool binary= ircon_wire_format(share) == IRCON_WIRE_FORMAT_BINARY;
+    const char *line= binary ? frame : "mode:-,\n";
+    size_t length= binary ? sizeof(frame) : 8;
+    ulong rate= ircon_rate_limit(share);
+
+    /* The reset replaces a line the rate limit holds back */
+    if (rate && !device->connection->admit(rate))
+      rc= defer_command(device->connection, line, length, rate);
+    else
+      rc= send_command(device->connection, line, length, 1, false);
+  }
+  if (share->multi_device)
+  {
+    /*
+      Slots do not move, so a running scan goes on with the next device.
+      The table is locked exclusively, no other statement holds the device.
+    */
+    share->forget_state(device);
+    mysql_mutex_unlock(&device->mutex);
+    share->remove_device(device);
+    current_device= NULL;
+  }
+  else
+  {
+    share->save_state(device);
+    mysql_mutex_unlock(&device->mutex);
+  }
+  DBUG_RETURN(rc);
 }
 
-/*
-  List of all system tables specific to the SE.
-  Array element would look like below,
-     { "<database_name>", "<system table name>" },
-  The last element MUST be,
-     { (const char*)NULL, (const char*)NULL }
-
-  This array is optional, so every SE need not implement it.
-*/
-static st_handler_tablename ha_ircon_system_tables[]= {
-  {(const char*)NULL, (const char*)NULL}
-};
 
 /**
-  @brief Check if the given db.tablename is a system table for this SE.
-
-  @param db                         Database name to check.
-  @param table_name                 table name to check.
-  @param is_sql_layer_system_table  if the supplied db.table_name is a SQL
-                                    layer system table.
+  @brief
+  Return the message of an engine error code.
 
   @return
-    @retval TRUE   Given db.table_name is supported system table.
-    @retval FALSE  Given db.table_name is not a supported system table.
+    true if the error is temporary, which none of ours are.
 */
-static bool ircon_is_supported_system_table(const char *db,
-                                              const char *table_name,
-                                              bool is_sql_layer_system_table)
+bool ha_ircon::get_error_message(int error, String *buf)
 {
-  st_handler_tablename *systab;
-
-  // Does this SE support "ALL" SQL layer system tables ?
-  if (is_sql_layer_system_table)
-    return false;
-
-  // Check if this is SE layer system tables
-  systab= ha_ircon_system_tables;
-  while (systab && systab->db)
+  DBUG_ENTER("ha_ircon::get_error_message");
+  if (error == IRCON_ERROR_INVALID_VALUE)
   {
-    if (systab->db == db &&
-        strcmp(systab->tablename, table_name) == 0)
-      return true;
-    systab++;
+    buf->append(STRING_WITH_LEN("Invalid value for IRCON column '"));
+    buf->append(error_field ? error_field : "");
+    buf->append('\'');
   }
-
-  return false;
+  else if (error == IRCON_ERROR_DICTIONARY_FULL)
+  {
+    buf->append(STRING_WITH_LEN("Too many distinct values for IRCON column '"));
+    buf->append(error_field ? error_field : "");
+    buf->append(STRING_WITH_LEN("', a table keeps at most 255 mode and angle "
+                                "values until FLUSH TABLES"));
+  }
+  else if (error == IRCON_ERROR_CIRCUIT_OPEN)
+  {
+    buf->append(STRING_WITH_LEN("IRCON device '"));
+    buf->append(error_endpoint ? error_endpoint : "");
+    buf->append(STRING_WITH_LEN("' is unreachable, commands fail until a "
+                                "health check reconnects"));
+  }
+  DBUG_RETURN(false);
 }
 
 
 /**
   @brief
-  Used for opening tables. The name will be the name of the file.
+  Refresh the cached state of a device from its gateway when it is older
+  than ircon_state_max_age.
 
   @details
-  A table is opened when it needs to be opened; e.g. when a request comes in
-  for a SELECT on the table (tables are not open and closed for each request,
-  they are cached).
-
-  Called from handler.cc by handler::ha_open(). The server opens all tables by
-  calling ha_open() which then calls the handler specific open().
-
-  @see
-  handler::ha_open() in handler.cc
+  The gateway is sent "?" and answers with a command line in the format
+  the engine sends, e.g. "mode:cool,temperature:25,\n". Reads that find
+  the cache stale race to claim the refresh, and only the winner queries;
+  the others, and every read when the query fails, use the cached state.
+  Unknown commands and invalid values in the answer are ignored.
 */
-
-int ha_ircon::open(const char *name, int mode, uint test_if_locked)
+void ha_ircon::read_back_state(Ircon_device *device)
 {
-  DBUG_ENTER("ha_ircon::open");
+  char response[IRCON_COMMAND_LINE_LENGTH];
+  size_t response_length;
+  ulonglong max_age= (ulonglong) srv_state_max_age * 1000;
+  int64 read_at;
+  int64 now;
+  DBUG_ENTER("ha_ircon::read_back_state");
+
+  if (!max_age)
+    DBUG_VOID_RETURN;
+  now= (int64) my_micro_time();
+  read_at= my_atomic_load64(&device->state_read_at);
+  if ((ulonglong) (now - read_at) < max_age ||
+      !my_atomic_cas64(&device->state_read_at, &read_at, now))
+    DBUG_VOID_RETURN;
+
+  my_atomic_add64(&ircon_state_queries, 1);
+  if (device->connection->query_line(STRING_WITH_LEN("?\n"), response,
+                                     sizeof(response), &response_length))
+  {
+    my_atomic_add64(&ircon_state_query_failures, 1);
+    DBUG_VOID_RETURN;
+  }
 
-  if (!(share = get_share()))
-    DBUG_RETURN(1);
-  thr_lock_data_init(&share->lock,&lock,NULL);
+  mysql_mutex_lock(&device->mutex);
+  mysql_rwlock_rdlock(&share->state_lock);
+  for (const char *pos= response, *end= response + response_length; pos < end;)
+  {
+    const char *item= pos;
+    const char *colon;
+    enum ircon_command command;
+    int code;
+
+    while (pos < end && *pos != ',')
+      pos++;
+    if ((colon= (const char*) memchr(item, ':', pos - item)) &&
+        (command= ircon_command_by_name(item, colon - item)) !=
+        IRCON_COMMAND_ID_NONE &&
+        !share->state.parse(command, colon + 1, pos - colon - 1, &code))
+      share->state.assign(device->slot, command, code);
+    pos++;
+  }
+  mysql_rwlock_unlock(&share->state_lock);
+  share->save_state(device);
+  mysql_mutex_unlock(&device->mutex);
+  DBUG_VOID_RETURN;
+}
 
-  if (!share->socket_opened) {
-    char *ip_port_buf = new char[32];
-    char *ip_ptr = ip_port_buf;
-    int port = 0;
-    struct sockaddr_in addr;
-    if((share->socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-      DBUG_RETURN(-1);
-    }
-
-    strncpy(ip_port_buf, table_share->table_name.str, 32);
-    for (int i = 0; i < 32; i++) {
-      if (ip_port_buf[i] == ':') {
-        ip_port_buf[i] = '\0';
-        if (i < 31) {
-          port = atoi(ip_port_buf + i + 1);
-        }
-        break;
-      }
-    }
-    if (port == 0) {
-      port = IRCON_DEFAULT_PORT;
-    }
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(ip_ptr);
-    delete ip_port_buf;
-    connect(share->socket, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
-    share->socket_opened = true;
+/**
+  @brief
+  Store the state of a device in the fields of a record buffer, which
+  need not be record[0]. Columns that are not device commands read as
+  IRCON_COMMAND_UNKNOWN, except the device key. Only the columns in
+  read_set are stored, unless all_columns is set.
+*/
+void ha_ircon::store_fields(uchar *buf, Ircon_device *device,
+                            bool all_columns)
+{
+  my_bitmap_map *org_bitmap;
+  my_ptrdiff_t offset= (my_ptrdiff_t) (buf - table->record[0]);
+  char value[IRCON_VALUE_LENGTH + 1];
+  enum ircon_command command;
 
-    strncpy(share->state_mode, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-    strncpy(share->state_temperature, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-    strncpy(share->state_power, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-    strncpy(share->state_angle, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
+  memset(buf, 0, table->s->null_bytes);
+  org_bitmap = tmp_use_all_columns(table, table->write_set);
+  for (Field **field = table->field; *field; field++) {
+    /* The device key is always filled, update_row() and delete_row() need it */
+    bool key= share->multi_device &&
+              (*field)->field_index == share->device_field;
+    if (!key && !all_columns &&
+        !bitmap_is_set(table->read_set, (*field)->field_index))
+      continue;
+    command= (enum ircon_command) field_commands[(*field)->field_index];
+    (*field)->move_field_offset(offset);
+    if (key)
+      (*field)->store(device->name, device->name_length, system_charset_info);
+    else if ((*field)->field_index == share->schedule_field)
+    {
+      /* Scheduled commands are not part of the state */
+      (*field)->reset();
+      (*field)->set_null();
+    }
+    else if (command == IRCON_COMMAND_ID_NONE)
+      (*field)->store(IRCON_COMMAND_UNKNOWN, sizeof(IRCON_COMMAND_UNKNOWN) - 1,
+                      system_charset_info);
+    else
+      (*field)->store(value, share->state.get(device->slot, command, value),
+                      system_charset_info);
+    (*field)->move_field_offset(-offset);
   }
-  DBUG_RETURN(0);
+  tmp_restore_column_map(table->write_set, org_bitmap);
 }
 
 
 /**
   @brief
-  Closes a table.
+  Fill a record buffer from a device.
 
   @details
-  Called from sql_base.cc, sql_select.cc, and table.cc. In sql_select.cc it is
-  only used to close up temporary tables or during the process where a
-  temporary table is converted over to being a myisam table.
-
-  For sql_base.cc look at close_data_tables().
-
-  @see
-  sql_base.cc, sql_select.cc and table.cc
+  Every device keeps its row as an image of the whole record, so a read
+  is one memcpy() while the state is unchanged. Each change of the state
+  raises the slot's version; the first read to see a version newer than
+  the image's stores the fields and copies the result into the image.
+  Readers and the rebuild agree through the image_seq seqlock, and never
+  wait: a read that finds the image being rebuilt stores the fields itself,
+  as do tables with BLOB columns, whose records point into the TABLE.
 */
-
-int ha_ircon::close(void)
+void ha_ircon::fill_record(uchar *buf, Ircon_device *device)
 {
-  DBUG_ENTER("ha_ircon::close");
+  size_t length= table->s->reclength;
 
-  shutdown(share->socket, SHUT_RDWR);
-  my_close(share->socket, MYF(0));
-  share->socket_opened = false;
+  read_back_state(device);
+  current_device= device;
+  if (table->s->blob_fields)
+  {
+    store_fields(buf, device, false);
+    return;
+  }
+  for (;;)
+  {
+    int32 seq= my_atomic_load32(&device->image_seq);
+    int32 version= share->state.state_version(device->slot);
+
+    if (!(seq & 1) && device->image_version == version)
+    {
+      memcpy(buf, device->image, length);
+      /* A rebuild that started after the version check tears the copy */
+      if (my_atomic_load32(&device->image_seq) == seq)
+      {
+        ircon_row_image_reads.add(1);
+        return;
+      }
+      continue;
+    }
 
-  DBUG_RETURN(0);
+    store_fields(buf, device, true);
+    if (!(seq & 1) && my_atomic_cas32(&device->image_seq, &seq, seq + 1))
+    {
+      if (device->image ||
+          (device->image= (uchar*) my_malloc(ircon_key_memory_devices, length,
+                                             MYF(0))))
+      {
+        memcpy(device->image, buf, length);
+        device->image_version= version;
+        my_atomic_add64(&ircon_row_image_builds, 1);
+      }
+      my_atomic_store32(&device->image_seq, seq + 2);
+    }
+    return;
+  }
 }
 
 
 /**
   @brief
-  write_row() inserts a row. No extra() hint is given currently if a bulk load
-  is happening. buf() is a byte array of data. You can use the field
-  information to extract the data from the native byte array type.
-
-  @details
-  Ircon of this would be:
-  @code
-  for (Field **field=table->field ; *field ; field++)
+  Read the next device in slot order starting at current_slot.
+*/
+int ha_ircon::next_device(uchar *buf)
+{
+  while (current_slot < share->device_slots)
   {
-    ...
+    uint slot= current_slot++;
+    Ircon_device *device= share->devices[slot];
+    if (!device)
+      continue;
+    if (pushed_predicates.size())
+    {
+      uint first= slot - slot % IRCON_FILTER_BLOCK;
+      if (first != filter_block)
+      {
+        filter_block= first;
+        filter_mask= filter_slots(first, MY_MIN(share->device_slots - first,
+                                                IRCON_FILTER_BLOCK));
+      }
+      if (!(filter_mask & ((ulonglong) 1 << (slot - first))))
+        continue;
+    }
+    fill_record(buf, device);
+    return 0;
   }
-  @endcode
-
-  See ha_tina.cc for an ircon of extracting all of the data as strings.
-  ha_berekly.cc has an ircon of how to store it intact by "packing" it
-  for ha_berkeley's own native storage type.
+  return HA_ERR_END_OF_FILE;
+}
 
-  See the note for update_row() on auto_increments. This case also applies to
-  write_row().
 
-  Called from item_sum.cc, item_sum.cc, sql_acl.cc, sql_insert.cc,
-  sql_insert.cc, sql_select.cc, sql_table.cc, sql_udf.cc, and sql_update.cc.
+/* Memoized results of a predicate on a temperature, in tenths */
+#define IRCON_FILTER_MAX_TENTHS 9999
 
-  @see
-  item_sum.cc, item_sum.cc, sql_acl.cc, sql_insert.cc,
-  sql_insert.cc, sql_select.cc, sql_table.cc, sql_udf.cc and sql_update.cc
+/**
+  @brief
+  Number of values filter_memo keeps for a predicate on a command.
 */
-int ha_ircon::init_writer(const char *ip) {
-  DBUG_ENTER("ha_ircon::init_writer");
-  DBUG_RETURN(0);
+static uint ircon_memo_size(enum ircon_command command)
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+  case IRCON_COMMAND_ID_ANGLE:
+    return 256;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    return 2 * IRCON_FILTER_MAX_TENTHS + 2;
+  case IRCON_COMMAND_ID_POWER:
+    return 3;
+  case IRCON_COMMAND_ID_NONE:
+    break;
+  }
+  return 1;
 }
 
-int ha_ircon::write_update_row(void) {
-  char attribute_buffer[1024];
-  String attribute(attribute_buffer, sizeof(attribute_buffer), &my_charset_bin);
-  my_bitmap_map *org_bitmap = tmp_use_all_columns(table, table->read_set);
-  for (Field **field = table->field; *field; field++) {
-    (*field)->val_str(&attribute, &attribute);
 
-    if (strncmp((*field)->field_name, IRCON_COMMAND_MODE, strlen((*field)->field_name)) == 0) {
-      if (attribute.length() > 0) {
-        strncpy(share->state_mode, attribute.ptr(), attribute.length());
-        share->state_mode[attribute.length()] = '\0';
-      }
-      send(share->socket, (*field)->field_name, strlen((*field)->field_name), 0);
-      send(share->socket, ":", 1, 0);
-      send(share->socket, share->state_mode, strlen(share->state_mode), 0);
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_TEMPERATURE, strlen((*field)->field_name)) == 0) {
-      if (attribute.length() > 0) {
-        strncpy(share->state_temperature, attribute.ptr(), attribute.length());
-        share->state_temperature[attribute.length()] = '\0';
-      }
-      send(share->socket, (*field)->field_name, strlen((*field)->field_name), 0);
-      send(share->socket, ":", 1, 0);
-      send(share->socket, share->state_temperature, strlen(share->state_temperature), 0);
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_POWER, strlen((*field)->field_name)) == 0) {
-      if (attribute.length() > 0) {
-        strncpy(share->state_power, attribute.ptr(), attribute.length());
-        share->state_power[attribute.length()] = '\0';
-      }
-      send(share->socket, (*field)->field_name, strlen((*field)->field_name), 0);
-      send(share->socket, ":", 1, 0);
-      send(share->socket, share->state_power, strlen(share->state_power), 0);
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_ANGLE, strlen((*field)->field_name)) == 0) {
-      if (attribute.length() > 0) {
-        strncpy(share->state_angle, attribute.ptr(), attribute.length());
-        share->state_angle[attribute.length()] = '\0';
-      }
-      send(share->socket, (*field)->field_name, strlen((*field)->field_name), 0);
-      send(share->socket, ":", 1, 0);
-      send(share->socket, share->state_angle, strlen(share->state_angle), 0);
-    } else {
-      continue;
-    }
-    send(share->socket, ",", 1, 0);
+/**
+  @brief
+  Index in the memoized results of a predicate of the code of a command.
+  Codes out of range, only found in a damaged state file, get an index
+  past ircon_memo_size() and are not filtered on.
+*/
+static uint ircon_memo_index(enum ircon_command command, int code)
+{
+  switch (command) {
+  case IRCON_COMMAND_ID_MODE:
+  case IRCON_COMMAND_ID_ANGLE:
+    return (uint) code;
+  case IRCON_COMMAND_ID_TEMPERATURE:
+    if (code == Ircon_state_store::TEMPERATURE_UNKNOWN)
+      return 0;
+    if (code < -IRCON_FILTER_MAX_TENTHS || code > IRCON_FILTER_MAX_TENTHS)
+      return UINT_MAX;
+    return (uint) (code + IRCON_FILTER_MAX_TENTHS + 1);
+  case IRCON_COMMAND_ID_POWER:
+    return (uint) (code + 1);
+  case IRCON_COMMAND_ID_NONE:
+    break;
   }
-  send(share->socket, "\n", 1, 0);
-  tmp_restore_column_map(table->read_set, org_bitmap);
-
   return 0;
 }
 
-int ha_ircon::write_row(uchar *buf)
+
+/**
+  @brief
+  Evaluate a pushed predicate for a value of its column, stored the way
+  fill_record() stores it.
+*/
+bool ha_ircon::evaluate_predicate(Ircon_pushed_predicate *predicate,
+                                  const char *value, size_t length)
 {
-  DBUG_ENTER("ha_ircon::write_row");
-  DBUG_RETURN(write_update_row());
+  my_bitmap_map *org_bitmap= tmp_use_all_columns(table, table->write_set);
+
+  predicate->field->set_notnull();
+  predicate->field->store(value, length, system_charset_info);
+  tmp_restore_column_map(table->write_set, org_bitmap);
+  return predicate->cond->val_int() != 0;
 }
 
 
 /**
   @brief
-  Yes, update_row() does what you expect, it updates a row. old_data will have
-  the previous row record in it, while new_data will have the newest data in it.
-  Keep in mind that the server can do updates based on ordering if an ORDER BY
-  clause was used. Consecutive ordering is not guaranteed.
+  Evaluate the pushed condition for count slots from first on.
 
   @details
-  Currently new_data will not have an updated auto_increament record. You can
-  do this for ircon by doing:
-
-  @code
-
-  if (table->next_number_field && record == table->record[0])
-    update_auto_increment();
+  Command columns are filtered a block at a time: the codes of the block
+  are gathered from the state column, and each looked up in the results
+  memoized for its value, so a predicate is evaluated at most once per
+  distinct value of the column. The device key differs for every device
+  and is evaluated per device. Slots past count, added since, pass.
 
-  @endcode
+  @return
+    Bitmap of the slots that pass.
+*/
+ulonglong ha_ircon::filter_slots(uint first, uint count)
+{
+  char value[IRCON_VALUE_LENGTH + 1];
+  int codes[IRCON_FILTER_BLOCK];
+  Ircon_device **devices= share->devices;
+  ulonglong mask= ~(ulonglong) 0;
 
-  Called from sql_select.cc, sql_acl.cc, sql_update.cc, and sql_insert.cc.
+  for (size_t i= 0; i < pushed_predicates.size() && mask; i++)
+  {
+    Ircon_pushed_predicate *predicate= &pushed_predicates[i];
+    int8 *memo= filter_memo + predicate->memo_offset;
+    uint size= ircon_memo_size(predicate->command);
+
+    if (predicate->device_key)
+    {
+      for (uint j= 0; j < count; j++)
+        if ((mask & ((ulonglong) 1 << j)) && devices[first + j] &&
+            !evaluate_predicate(predicate, devices[first + j]->name,
+                                devices[first + j]->name_length))
+          mask&= ~((ulonglong) 1 << j);
+      continue;
+    }
+    if (predicate->command == IRCON_COMMAND_ID_NONE)
+    {
+      /* The column always reads as IRCON_COMMAND_UNKNOWN */
+      if (*memo < 0)
+        *memo= evaluate_predicate(predicate, STRING_WITH_LEN(IRCON_COMMAND_UNKNOWN));
+      if (!*memo)
+        mask= 0;
+      continue;
+    }
+    if (!filter_state)
+      continue;
 
-  @see
-  sql_select.cc, sql_acl.cc, sql_update.cc and sql_insert.cc
-*/
-int ha_ircon::update_row(const uchar *old_data, uchar *new_data)
-{
-  DBUG_ENTER("ha_ircon::update_row");
-  DBUG_RETURN(write_update_row());
+    share->state.gather(first, count, predicate->command, codes);
+    for (uint j= 0; j < count; j++)
+    {
+      uint index= ircon_memo_index(predicate->command, codes[j]);
+      if (!(mask & ((ulonglong) 1 << j)) || index >= size)
+        continue;
+      if (memo[index] < 0)
+        memo[index]= evaluate_predicate(predicate, value,
+                                        share->state.format(predicate->command,
+                                                            codes[j], value));
+      if (!memo[index])
+        mask&= ~((ulonglong) 1 << j);
+    }
+  }
+  return mask;
 }
 
 
 /**
   @brief
-  This will delete a row. buf will contain a copy of the row to be deleted.
-  The server will call this right after the current row has been called (from
-  either a previous rnd_nexT() or index call).
+  Start evaluating the pushed condition for a new scan. The memoized
+  results are dropped because constants of the condition, such as
+  parameters of a prepared statement, may have changed. With
+  ircon_state_max_age set, reads may refresh the cached state, so it is
+  not filtered on.
+*/
+void ha_ircon::start_filter()
+{
+  if (filter_memo_used)
+    memset(filter_memo, -1, filter_memo_used);
+  filter_block= UINT_MAX;
+  filter_state= !srv_state_max_age;
+}
 
-  @details
-  If you keep a pointer to the last row or can access a primary key it will
-  make doing the deletion quite a bit easier. Keep in mind that the server does
-  not guarantee consecutive deletions. ORDER BY clauses can be used.
 
-  Called in sql_acl.cc and sql_udf.cc to manage internal table
-  information.  Called in sql_delete.cc, sql_insert.cc, and
-  sql_select.cc. In sql_select it is used for removing duplicates
-  while in insert it is used for REPLACE calls.
+int ha_ircon::index_init(uint idx, bool sorted)
+{
+  DBUG_ENTER("ha_ircon::index_init");
+  active_index= idx;
+  current_slot= 0;
+  start_filter();
+  DBUG_RETURN(0);
+}
 
-  @see
-  sql_acl.cc, sql_udf.cc, sql_delete.cc, sql_insert.cc and sql_select.cc
-*/
 
-int ha_ircon::delete_row(const uchar *buf)
+int ha_ircon::index_end()
 {
-  DBUG_ENTER("ha_ircon::delete_row");
-  strncpy(share->state_mode, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-  strncpy(share->state_temperature, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-  strncpy(share->state_power, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-  strncpy(share->state_angle, IRCON_COMMAND_UNKNOWN, IRCON_COMMAND_LENGTH);
-  send(share->socket, "mode:-,\n", 8, 0);
+  DBUG_ENTER("ha_ircon::index_end");
+  active_index= MAX_KEY;
   DBUG_RETURN(0);
 }
 
@@ -510,17 +6033,57 @@ int ha_ircon::delete_row(const uchar *buf)
   Positions an index cursor to the index specified in the handle. Fetches the
   row if available. If the key value is null, begin at the first key of the
   index.
+
+  @details
+  The device key is a hash index, so only exact lookups are supported.
+  index_next() continues in slot order, which lets the default
+  index_next_same() stop after the one matching device.
 */
 
 int ha_ircon::index_read_map(uchar *buf, const uchar *key,
                                key_part_map keypart_map MY_ATTRIBUTE((unused)),
-                               enum ha_rkey_function find_flag
-                               MY_ATTRIBUTE((unused)))
+                               enum ha_rkey_function find_flag)
 {
   int rc;
+  KEY_PART_INFO *key_part;
+  const uchar *name;
+  uint length;
+  Ircon_device *device;
   DBUG_ENTER("ha_ircon::index_read");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  rc= HA_ERR_WRONG_COMMAND;
+
+  if (find_flag != HA_READ_KEY_EXACT)
+  {
+    rc= HA_ERR_WRONG_COMMAND;
+    goto end;
+  }
+
+  key_part= table->key_info[active_index].key_part;
+  name= key;
+  length= key_part->length;
+  if (key_part->null_bit)
+    name++;
+  if (key_part->key_part_flag & HA_VAR_LENGTH_PART)
+  {
+    length= uint2korr(name);
+    name+= HA_KEY_BLOB_LENGTH;
+  }
+  else
+  {
+    while (length > 0 && name[length - 1] == ' ')
+      length--;
+  }
+
+  if (!(device= share->find_device((const char*) name, length)))
+  {
+    rc= HA_ERR_KEY_NOT_FOUND;
+    goto end;
+  }
+  fill_record(buf, device);
+  current_slot= device->slot + 1;
+  rc= 0;
+
+end:
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -536,7 +6099,7 @@ int ha_ircon::index_next(uchar *buf)
   int rc;
   DBUG_ENTER("ha_ircon::index_next");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  rc= HA_ERR_WRONG_COMMAND;
+  rc= next_device(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -573,7 +6136,8 @@ int ha_ircon::index_first(uchar *buf)
   int rc;
   DBUG_ENTER("ha_ircon::index_first");
   MYSQL_INDEX_READ_ROW_START(table_share->db.str, table_share->table_name.str);
-  rc= HA_ERR_WRONG_COMMAND;
+  current_slot= 0;
+  rc= next_device(buf);
   MYSQL_INDEX_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -616,13 +6180,17 @@ int ha_ircon::index_last(uchar *buf)
 int ha_ircon::rnd_init(bool scan)
 {
   DBUG_ENTER("ha_ircon::rnd_init");
-  next_is_eof = false;
+  current_slot= 0;
+  start_filter();
+  scan_start= ircon_profile_start();
   DBUG_RETURN(0);
 }
 
 int ha_ircon::rnd_end()
 {
   DBUG_ENTER("ha_ircon::rnd_end");
+  ircon_profile_end(IRCON_OPERATION_SCAN, scan_start);
+  scan_start= 0;
   DBUG_RETURN(0);
 }
 
@@ -643,41 +6211,16 @@ int ha_ircon::rnd_end()
 */
 int ha_ircon::rnd_next(uchar *buf)
 {
-  my_bitmap_map *org_bitmap;
+  ulonglong start= ircon_profile_start();
   int rc;
-  char *res = NULL;
   DBUG_ENTER("ha_ircon::rnd_next");
 
   MYSQL_READ_ROW_START(table_share->db.str, table_share->table_name.str,
                        TRUE);
-
-  if (next_is_eof) {
-    rc= HA_ERR_END_OF_FILE;
-    MYSQL_READ_ROW_DONE(rc);
-    DBUG_RETURN(rc);
-  }
-
-  memset(buf, 0, table->s->null_bytes);
-  org_bitmap = tmp_use_all_columns(table, table->write_set);
-  for (Field **field = table->field; *field; field++) {
-    if (strncmp((*field)->field_name, IRCON_COMMAND_MODE, (*field)->field_length) == 0) {
-      res = share->state_mode;
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_TEMPERATURE, (*field)->field_length) == 0) {
-      res = share->state_temperature;
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_POWER, (*field)->field_length) == 0) {
-      res = share->state_power;
-    } else if (strncmp((*field)->field_name, IRCON_COMMAND_ANGLE, (*field)->field_length) == 0) {
-      res = share->state_angle;
-    } else {
-      res = (char *)IRCON_COMMAND_UNKNOWN;
-    }
-    (*field)->store(res, strlen(res), system_charset_info);
-  }
-  tmp_restore_column_map(table->write_set, org_bitmap);
-  stats.records++;
-
-  next_is_eof = true;
-  DBUG_RETURN(0);
+  rc= next_device(buf);
+  MYSQL_READ_ROW_DONE(rc);
+  ircon_profile_end(IRCON_OPERATION_READ, start);
+  DBUG_RETURN(rc);
 }
 
 
@@ -697,6 +6240,9 @@ int ha_ircon::rnd_next(uchar *buf)
   current_position should be the offset. If it is a primary key like in
   BDB, then it needs to be a primary key.
 
+  We store the slot of the device last read, together with its id so that
+  rnd_pos() notices a slot reused by another device.
+
   Called from filesort.cc, sql_select.cc, sql_delete.cc, and sql_update.cc.
 
   @see
@@ -705,6 +6251,13 @@ int ha_ircon::rnd_next(uchar *buf)
 void ha_ircon::position(const uchar *record)
 {
   DBUG_ENTER("ha_ircon::position");
+  if (current_device)
+  {
+    my_store_ptr(ref, sizeof(uint32), current_device->slot);
+    my_store_ptr(ref + sizeof(uint32), sizeof(ulonglong), current_device->id);
+  }
+  else
+    memset(ref, 0xff, ref_length);
   DBUG_VOID_RETURN;
 }
 
@@ -725,10 +6278,22 @@ void ha_ircon::position(const uchar *record)
 int ha_ircon::rnd_pos(uchar *buf, uchar *pos)
 {
   int rc;
+  uint slot;
+  ulonglong id;
+  Ircon_device *device;
   DBUG_ENTER("ha_ircon::rnd_pos");
   MYSQL_READ_ROW_START(table_share->db.str, table_share->table_name.str,
                        TRUE);
-  rc= HA_ERR_WRONG_COMMAND;
+  slot= (uint) my_get_ptr(pos, sizeof(uint32));
+  id= (ulonglong) my_get_ptr(pos + sizeof(uint32), sizeof(ulonglong));
+  if (slot >= share->device_slots || !(device= share->devices[slot]) ||
+      device->id != id)
+    rc= HA_ERR_RECORD_DELETED;
+  else
+  {
+    fill_record(buf, device);
+    rc= 0;
+  }
   MYSQL_READ_ROW_DONE(rc);
   DBUG_RETURN(rc);
 }
@@ -775,11 +6340,65 @@ int ha_ircon::rnd_pos(uchar *buf, uchar *pos)
 int ha_ircon::info(uint flag)
 {
   DBUG_ENTER("ha_ircon::info");
-  stats.records = 2;
+  if (flag & HA_STATUS_VARIABLE)
+  {
+    /*
+      Exact as of now, see HA_STATS_RECORDS_IS_EXACT. Freed slots are
+      counted as deleted rows, as a scan steps over them.
+    */
+    uint slots= share->device_slots;
+    stats.records= share->device_count;
+    stats.deleted= slots > stats.records ? slots - stats.records : 0;
+    stats.mean_rec_length= table_share->reclength;
+    stats.data_file_length= (ulonglong) slots * table_share->reclength;
+  }
   DBUG_RETURN(0);
 }
 
 
+/*
+  Optimizer costs in units of a block read: a row of cached state, a row
+  that may be queried from its device, and a probe of the device index
+*/
+#define IRCON_CACHED_ROW_COST 0.001
+#define IRCON_QUERY_ROW_COST 0.1
+#define IRCON_LOOKUP_COST 0.01
+
+/**
+  @brief
+  Cost of reading one row, in the optimizer's units of a block read. A
+  row is a few bytes of cached state; with ircon_state_max_age set, reads
+  also query the device now and then, a LAN round trip each.
+*/
+static double ircon_row_read_cost()
+{
+  return srv_state_max_age ? IRCON_QUERY_ROW_COST : IRCON_CACHED_ROW_COST;
+}
+
+
+/**
+  @brief
+  A scan reads every slot in memory: one block for the setup plus the
+  rows, freed slots included.
+*/
+double ha_ircon::scan_time()
+{
+  return 1.0 + (double) (stats.records + stats.deleted) * ircon_row_read_cost();
+}
+
+
+/**
+  @brief
+  A lookup in the device index is a hash probe per range plus the rows
+  read, so it beats a scan of any table of more than one device.
+*/
+double ha_ircon::read_time(uint index, uint ranges, ha_rows rows)
+{
+  return (double) ranges * IRCON_LOOKUP_COST +
+         (double) rows * ircon_row_read_cost();
+}
+
+
 /**
   @brief
   extra() is called whenever the server wishes to send a hint to
@@ -796,6 +6415,108 @@ int ha_ircon::extra(enum ha_extra_function operation)
 }
 
 
+/**
+  @brief
+  Called at the end of each statement. The pushed condition goes with
+  it.
+*/
+int ha_ircon::reset()
+{
+  DBUG_ENTER("ha_ircon::reset");
+  cond_pop();
+  bulk_insert= false;
+  DBUG_RETURN(0);
+}
+
+
+/**
+  @brief
+  Take the conjuncts of a pushed condition that depend on a single column
+  of the table, so that scans skip the devices failing them without
+  filling their rows, let alone querying the devices for their state.
+
+  @details
+  The conjuncts are evaluated with their own Items, against the values
+  their column takes, so comparisons follow the column type and collation
+  exactly as when the server evaluates them; see filter_slots().
+  Conjuncts with subqueries, stored functions or RAND() are left alone.
+
+  @return
+    The condition, as the server still evaluates all of it.
+*/
+const Item *ha_ircon::cond_push(const Item *cond)
+{
+  Item *item= const_cast<Item*>(cond);
+  DBUG_ENTER("ha_ircon::cond_push");
+
+  cond_pop();
+  if (item->type() == Item::COND_ITEM &&
+      ((Item_cond*) item)->functype() == Item_func::COND_AND_FUNC)
+  {
+    List_iterator_fast<Item> it(*((Item_cond*) item)->argument_list());
+    Item *conjunct;
+    while ((conjunct= it++))
+      push_predicate(conjunct);
+  }
+  else
+    push_predicate(item);
+  DBUG_RETURN(cond);
+}
+
+
+void ha_ircon::cond_pop()
+{
+  pushed_predicates.clear();
+  filter_memo_used= 0;
+}
+
+
+/**
+  @brief
+  Add a conjunct of a pushed condition to pushed_predicates if it depends
+  on one column of the table only.
+
+  @return
+    true if it was added.
+*/
+bool ha_ircon::push_predicate(Item *cond)
+{
+  List<Item_field> fields;
+  Ircon_pushed_predicate predicate;
+  uint size;
+
+  if (cond->has_subquery() || cond->is_expensive() ||
+      (cond->used_tables() & RAND_TABLE_BIT) ||
+      cond->walk(&Item::collect_item_field_processor, Item::WALK_POSTFIX,
+                 (uchar*) &fields) ||
+      fields.elements != 1 || fields.head()->field->table != table)
+    return false;
+
+  predicate.cond= cond;
+  predicate.field= fields.head()->field;
+  predicate.device_key= share->multi_device &&
+                        predicate.field->field_index == share->device_field;
+  predicate.command= predicate.device_key ? IRCON_COMMAND_ID_NONE :
+    (enum ircon_command) field_commands[predicate.field->field_index];
+  predicate.memo_offset= filter_memo_used;
+  size= predicate.device_key ? 0 : ircon_memo_size(predicate.command);
+  if (filter_memo_used + size > filter_memo_size)
+  {
+    uint memo_size= MY_MAX(filter_memo_size * 2, filter_memo_used + size);
+    int8 *memo;
+    if (!(memo= (int8*) my_realloc(ircon_key_memory_filter, filter_memo,
+                                   memo_size, MYF(MY_ALLOW_ZERO_PTR))))
+      return false;
+    filter_memo= memo;
+    filter_memo_size= memo_size;
+  }
+  if (pushed_predicates.push_back(predicate))
+    return false;
+  filter_memo_used+= size;
+  return true;
+}
+
+
 /**
   @brief
   Used to delete all rows in a table, including cases of truncate and cases where
@@ -864,11 +6585,87 @@ int ha_ircon::truncate()
 */
 int ha_ircon::external_lock(THD *thd, int lock_type)
 {
+  Ircon_statement *statement= (Ircon_statement*) thd_get_ha_data(thd, ht);
+  int rc;
   DBUG_ENTER("ha_ircon::external_lock");
+  if (lock_type == F_UNLCK)
+  {
+    rc= end_statement(true);
+    /* The last handler out frees the devices UPDATEs moved to new keys */
+    if (my_atomic_add32(&share->locked, -1) == 1 && share->retired_devices)
+      share->reclaim_devices();
+    DBUG_RETURN(rc);
+  }
+  if (!statement)
+  {
+    if (!(statement= new Ircon_statement))
+      DBUG_RETURN(HA_ERR_OUT_OF_MEM);
+    thd_set_ha_data(thd, ht, statement);
+  }
+  statement->tables_locked++;
+  my_atomic_add32(&share->locked, 1);
   DBUG_RETURN(0);
 }
 
 
+/**
+  @brief
+  Called at the start of a multi-row INSERT or LOAD DATA. Its rows are
+  batched as with ircon_batch_commands, so write_row() only updates the
+  device state and appends to pending_devices, sized here for the
+  estimated rows up to ircon_bulk_flush_devices; the commands go out in
+  chunks of that many devices, and at end_bulk_insert().
+
+  @param rows  Estimated rows, 0 if unknown.
+*/
+void ha_ircon::start_bulk_insert(ha_rows rows)
+{
+  DBUG_ENTER("ha_ircon::start_bulk_insert");
+  bulk_insert= true;
+  if (rows > pending_devices.size())
+    pending_devices.reserve((size_t) MY_MIN(rows, srv_bulk_flush_devices));
+  DBUG_VOID_RETURN;
+}
+
+
+/**
+  @brief
+  Called at the end of a multi-row INSERT or LOAD DATA; sends the command
+  queued by batched write_row() calls. They are waited for when the table
+  is unlocked, or right away under LOCK TABLES, where that is only at
+  UNLOCK TABLES.
+*/
+int ha_ircon::end_bulk_insert()
+{
+  DBUG_ENTER("ha_ircon::end_bulk_insert");
+  bulk_insert= false;
+  if (thd_in_lock_tables(ha_thd()))
+    DBUG_RETURN(end_statement(false));
+  DBUG_RETURN(flush_pending());
+}
+
+
+/**
+  @brief
+  Whether the statement may free devices of the table, so that it needs
+  the table to itself.
+*/
+static bool ircon_frees_devices(THD *thd, const Ircon_share *share)
+{
+  if (!share->multi_device)
+    return false;
+  switch (thd_sql_command(thd)) {
+  case SQLCOM_DELETE:
+  case SQLCOM_DELETE_MULTI:
+  case SQLCOM_REPLACE:
+  case SQLCOM_REPLACE_SELECT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+
 /**
   @brief
   The idea with handler::store_lock() is: The statement decides which locks
@@ -886,6 +6683,13 @@ int ha_ircon::external_lock(THD *thd, int lock_type)
   (which signals that we are doing WRITES, but are still allowing other
   readers and writers).
 
+  So does ircon, outside LOCK TABLES: each device's mutex serializes the
+  writes to it, so statements writing different devices run in parallel.
+  DELETE and REPLACE keep the TL_WRITE they ask for on multi-device
+  tables, as they free devices that concurrent statements could hold.
+  INSERT ... SELECT gets TL_READ rather than TL_READ_NO_INSERT for the
+  table read, like ha_federated does.
+
   When releasing locks, store_lock() is also called. In this case one
   usually doesn't have to do anything.
 
@@ -911,7 +6715,14 @@ THR_LOCK_DATA **ha_ircon::store_lock(THD *thd,
                                        enum thr_lock_type lock_type)
 {
   if (lock_type != TL_IGNORE && lock.type == TL_UNLOCK)
+  {
+    if (lock_type >= TL_WRITE_CONCURRENT_INSERT && lock_type <= TL_WRITE &&
+        !thd_in_lock_tables(thd) && !ircon_frees_devices(thd, share))
+      lock_type= TL_WRITE_ALLOW_WRITE;
+    else if (lock_type == TL_READ_NO_INSERT && !thd_in_lock_tables(thd))
+      lock_type= TL_READ;
     lock.type=lock_type;
+  }
   *to++= &lock;
   return to;
 }
@@ -938,9 +6749,11 @@ THR_LOCK_DATA **ha_ircon::store_lock(THD *thd,
 */
 int ha_ircon::delete_table(const char *name)
 {
+  int error;
   DBUG_ENTER("ha_ircon::delete_table");
-  /* This is not implemented but we want someone to be able that it works. */
-  DBUG_RETURN(0);
+  /* Tables created before state files existed have none */
+  error= handler::delete_table(name);
+  DBUG_RETURN(error == ENOENT ? 0 : error);
 }
 
 
@@ -982,7 +6795,8 @@ ha_rows ha_ircon::records_in_range(uint inx, key_range *min_key,
                                      key_range *max_key)
 {
   DBUG_ENTER("ha_ircon::records_in_range");
-  DBUG_RETURN(10);                         // low number to force index usage
+  /* The device key is unique and only matched whole */
+  DBUG_RETURN(1);
 }
 
 
@@ -1010,9 +6824,11 @@ int ha_ircon::create(const char *name, TABLE *table_arg,
 {
   DBUG_ENTER("ha_ircon::create");
   /*
-    This is not implemented but we want someone to be able to see that it
-    works.
+    The only index we can maintain is the device key of a multi-device
+    table.
   */
+  if (table_arg->s->keys && !ircon_is_multi_device(table_arg->s))
+    DBUG_RETURN(HA_WRONG_CREATE_OPTION);
   DBUG_RETURN(0);
 }
 
@@ -1081,6 +6897,29 @@ static MYSQL_THDVAR_DOUBLE(
   0);
 
 static struct st_mysql_sys_var* ircon_system_variables[]= {
+  MYSQL_SYSVAR(connect_timeout),
+  MYSQL_SYSVAR(breaker_threshold),
+  MYSQL_SYSVAR(health_check_interval),
+  MYSQL_SYSVAR(resolve_ttl),
+  MYSQL_SYSVAR(pool_max_idle),
+  MYSQL_SYSVAR(dedup_ttl),
+  MYSQL_SYSVAR(rate_limit),
+  MYSQL_SYSVAR(rate_burst),
+  MYSQL_SYSVAR(profile),
+  MYSQL_SYSVAR(schedule_batch),
+  MYSQL_SYSVAR(state_max_age),
+  MYSQL_SYSVAR(read_timeout),
+  MYSQL_SYSVAR(durability),
+  MYSQL_SYSVAR(wire_format),
+  MYSQL_SYSVAR(queue_size),
+  MYSQL_SYSVAR(event_threads),
+  MYSQL_SYSVAR(pipeline_window),
+  MYSQL_SYSVAR(journal_file),
+  MYSQL_SYSVAR(journal_size),
+  MYSQL_SYSVAR(journal_sync_interval),
+  MYSQL_SYSVAR(journal_sync_commands),
+  MYSQL_SYSVAR(batch_commands),
+  MYSQL_SYSVAR(bulk_flush_devices),
   MYSQL_SYSVAR(enum_var),
   MYSQL_SYSVAR(ulong_var),
   MYSQL_SYSVAR(double_var),
@@ -1088,55 +6927,368 @@ static struct st_mysql_sys_var* ircon_system_variables[]= {
   NULL
 };
 
-// this is an ircon of SHOW_FUNC and of my_snprintf() service
-static int show_func_ircon(MYSQL_THD thd, struct st_mysql_show_var *var,
-                             char *buf)
+static int show_queue_depth(MYSQL_THD thd, struct st_mysql_show_var *var,
+                            char *buf)
 {
-  var->type= SHOW_CHAR;
-  var->value= buf; // it's of SHOW_VAR_FUNC_BUFF_SIZE bytes
-  my_snprintf(buf, SHOW_VAR_FUNC_BUFF_SIZE,
-              "enum_var is %lu, ulong_var is %lu, "
-              "double_var is %f, %.6b", // %b is a MySQL extension
-              srv_enum_var, srv_ulong_var, srv_double_var, "really");
+  var->type= SHOW_LONGLONG;
+  var->value= buf;
+  *(longlong*) buf= my_atomic_load64(&ircon_output_depth);
   return 0;
 }
 
-struct ircon_vars_t
+/* Snapshot of the striped counters, filled by show_ircon_counters() */
+static longlong ircon_commands_sent_value;
+static longlong ircon_row_image_reads_value;
+static longlong ircon_bytes_sent_value;
+
+static st_mysql_show_var ircon_counters[]=
 {
-	ulong  var1;
-	double var2;
-	char   var3[64];
-  bool   var4;
-  bool   var5;
-  ulong  var6;
+  {"commands_sent", (char *)&ircon_commands_sent_value, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"bytes_sent", (char *)&ircon_bytes_sent_value, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"row_image_reads", (char *)&ircon_row_image_reads_value, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {0,0,SHOW_UNDEF, SHOW_SCOPE_UNDEF}
 };
 
-ircon_vars_t ircon_vars= {100, 20.01, "three hundred", true, 0, 8250};
-
-static st_mysql_show_var show_status_ircon[]=
+static int show_ircon_counters(MYSQL_THD thd, struct st_mysql_show_var *var,
+                               char *buf)
 {
-  {"var1", (char *)&ircon_vars.var1, SHOW_LONG, SHOW_SCOPE_GLOBAL},
-  {"var2", (char *)&ircon_vars.var2, SHOW_DOUBLE, SHOW_SCOPE_GLOBAL},
-  {0,0,SHOW_UNDEF, SHOW_SCOPE_UNDEF} // null terminator required
-};
+  /* Concurrent SHOW STATUS may interleave here, each still sees a sum */
+  ircon_commands_sent_value= ircon_commands_sent.sum();
+  ircon_row_image_reads_value= ircon_row_image_reads.sum();
+  ircon_bytes_sent_value= ircon_bytes_sent.sum();
+  var->type= SHOW_ARRAY;
+  var->value= (char *) ircon_counters;
+  return 0;
+}
 
-static struct st_mysql_show_var show_array_ircon[]=
+static st_mysql_show_var ircon_latency_status[]=
 {
-  {"array", (char *)show_status_ircon, SHOW_ARRAY, SHOW_SCOPE_GLOBAL},
-  {"var3", (char *)&ircon_vars.var3, SHOW_CHAR, SHOW_SCOPE_GLOBAL},
-  {"var4", (char *)&ircon_vars.var4, SHOW_BOOL, SHOW_SCOPE_GLOBAL},
+  {"lt_1us", (char *)&ircon_send_latency[0], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_2us", (char *)&ircon_send_latency[1], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_4us", (char *)&ircon_send_latency[2], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_8us", (char *)&ircon_send_latency[3], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_16us", (char *)&ircon_send_latency[4], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_32us", (char *)&ircon_send_latency[5], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_64us", (char *)&ircon_send_latency[6], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_128us", (char *)&ircon_send_latency[7], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_256us", (char *)&ircon_send_latency[8], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_512us", (char *)&ircon_send_latency[9], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_1ms", (char *)&ircon_send_latency[10], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_2ms", (char *)&ircon_send_latency[11], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_4ms", (char *)&ircon_send_latency[12], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_8ms", (char *)&ircon_send_latency[13], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_16ms", (char *)&ircon_send_latency[14], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_32ms", (char *)&ircon_send_latency[15], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_65ms", (char *)&ircon_send_latency[16], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_131ms", (char *)&ircon_send_latency[17], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_262ms", (char *)&ircon_send_latency[18], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_524ms", (char *)&ircon_send_latency[19], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"lt_1s", (char *)&ircon_send_latency[20], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ge_1s", (char *)&ircon_send_latency[21], SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
   {0,0,SHOW_UNDEF, SHOW_SCOPE_UNDEF}
 };
 
 static struct st_mysql_show_var func_status[]=
 {
-  {"ircon_func_ircon", (char *)show_func_ircon, SHOW_FUNC, SHOW_SCOPE_GLOBAL},
-  {"ircon_status_var5", (char *)&ircon_vars.var5, SHOW_BOOL, SHOW_SCOPE_GLOBAL},
-  {"ircon_status_var6", (char *)&ircon_vars.var6, SHOW_LONG, SHOW_SCOPE_GLOBAL},
-  {"ircon_status",  (char *)show_array_ircon, SHOW_ARRAY, SHOW_SCOPE_GLOBAL},
+  {"ircon", (char *)show_ircon_counters, SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"ircon_connect_attempts", (char *)&ircon_connect_attempts, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_connect_failures", (char *)&ircon_connect_failures, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_reconnects", (char *)&ircon_reconnects, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_breakers_open", (char *)&ircon_breakers_open, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_breaker_trips", (char *)&ircon_breaker_trips, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_breaker_rejects", (char *)&ircon_breaker_rejects, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_health_checks", (char *)&ircon_health_checks, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_resolves", (char *)&ircon_resolves, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_resolve_failures", (char *)&ircon_resolve_failures, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_journal_records", (char *)&ircon_journal_records, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_journal_replayed", (char *)&ircon_journal_replayed, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_journal_overflows", (char *)&ircon_journal_overflows, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_journal_syncs", (char *)&ircon_journal_syncs, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_send_latency", (char *)ircon_latency_status, SHOW_ARRAY, SHOW_SCOPE_GLOBAL},
+  {"ircon_send_syscalls_saved", (char *)&ircon_send_syscalls_saved, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_batch_commands_collapsed", (char *)&ircon_batch_commands_collapsed, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_state_queries", (char *)&ircon_state_queries, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_state_query_failures", (char *)&ircon_state_query_failures, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_suppressed", (char *)&ircon_commands_suppressed, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_row_image_builds", (char *)&ircon_row_image_builds, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_deferred", (char *)&ircon_commands_deferred, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_coalesced", (char *)&ircon_commands_coalesced, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_deferred_dropped", (char *)&ircon_deferred_dropped, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_scheduled", (char *)&ircon_commands_scheduled, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_schedule_pending", (char *)&ircon_schedule_pending, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_queue_depth", (char *)show_queue_depth, SHOW_FUNC, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_acked", (char *)&ircon_commands_acked, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_commands_unacked", (char *)&ircon_commands_unacked, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_queue_full_waits", (char *)&ircon_queue_full_waits, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
+  {"ircon_async_send_errors", (char *)&ircon_async_send_errors, SHOW_LONGLONG, SHOW_SCOPE_GLOBAL},
   {0,0,SHOW_UNDEF, SHOW_SCOPE_UNDEF}
 };
 
+
+/*
+  INFORMATION_SCHEMA.IRCON_DEVICES: one row per pooled device connection.
+*/
+
+static ST_FIELD_INFO ircon_devices_fields_info[]=
+{
+  {"ENDPOINT", IRCON_ENDPOINT_LENGTH, MYSQL_TYPE_STRING, 0, 0, 0,
+   SKIP_OPEN_TABLE},
+  {"STATE", 16, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+  {"TABLES", MY_INT32_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONG, 0,
+   MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+  {"COMMANDS_SENT", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+   MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+  {"BYTES_SENT", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+   MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+  {"CONNECT_FAILURES", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+   MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+  {"LAST_COMMAND_TIME", 0, MYSQL_TYPE_DATETIME, 0, MY_I_S_MAYBE_NULL, 0,
+   SKIP_OPEN_TABLE},
+  {"COMMANDS_PER_SEC", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_DOUBLE, 0, 0,
+   0, SKIP_OPEN_TABLE},
+  {"SEND_LATENCY_P50_US", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {"SEND_LATENCY_P99_US", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {"LAST_COMMAND", IRCON_COMMAND_LINE_LENGTH, MYSQL_TYPE_STRING, 0, 0, 0,
+   SKIP_OPEN_TABLE},
+  {"BREAKER", 16, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+  {"SEND_LATENCY_P999_US", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {0, 0, MYSQL_TYPE_NULL, 0, 0, 0, 0}
+};
+
+/* What the fill function copies out of a connection under its mutex */
+struct Ircon_connection_stats
+{
+  char endpoint[IRCON_ENDPOINT_LENGTH];
+  uint endpoint_length;
+  enum ircon_connection_state state;
+  enum ircon_breaker_state breaker;
+  uint ref_count;
+  ulonglong commands_sent;
+  ulonglong bytes_sent;
+  ulonglong connect_failures;
+  ulonglong latency[IRCON_LATENCY_BUCKETS];
+  time_t last_sent_at;
+  double send_rate;
+  char last_command[IRCON_COMMAND_LINE_LENGTH];
+  uint last_command_length;
+};
+
+/**
+  @brief
+  Return the upper bound in microseconds of the histogram bucket holding
+  the given fraction of the samples.
+
+  @return
+    The bound, or -1 if there are no samples.
+*/
+static longlong ircon_latency_percentile(const ulonglong *latency,
+                                         uint buckets, double fraction)
+{
+  ulonglong total= 0;
+  ulonglong seen= 0;
+
+  for (uint i= 0; i < buckets; i++)
+    total+= latency[i];
+  if (!total)
+    return -1;
+  for (uint i= 0; i < buckets; i++)
+  {
+    seen+= latency[i];
+    if (seen >= fraction * total)
+      return 1LL << i;
+  }
+  return 1LL << (buckets - 1);
+}
+
+static void ircon_store_percentile(Field *field, const ulonglong *latency,
+                                   double fraction,
+                                   uint buckets= IRCON_LATENCY_BUCKETS)
+{
+  longlong value= ircon_latency_percentile(latency, buckets, fraction);
+  if (value < 0)
+    field->set_null();
+  else
+  {
+    field->set_notnull();
+    field->store(value, true);
+  }
+}
+
+static int ircon_devices_fill_table(THD *thd, TABLE_LIST *tables, Item *cond)
+{
+  static const char *state_names[]=
+    {"closed", "connecting", "connected", "failed"};
+  static const char *breaker_names[]= {"closed", "open", "half-open"};
+  TABLE *table= tables->table;
+  Field **field= table->field;
+  Ircon_connection_stats *stats;
+  ulong count;
+  ulonglong now= my_micro_time();
+  DBUG_ENTER("ircon_devices_fill_table");
+
+  if (!ircon_connections_ready)
+    DBUG_RETURN(0);
+
+  /* Snapshot first, storing rows may be slow and must not block the pool */
+  mysql_mutex_lock(&ircon_connections_mutex);
+  count= ircon_connections.records;
+  if (!(stats= (Ircon_connection_stats*) thd->alloc(count * sizeof(*stats) + 1)))
+  {
+    mysql_mutex_unlock(&ircon_connections_mutex);
+    DBUG_RETURN(1);
+  }
+  for (ulong i= 0; i < count; i++)
+  {
+    Ircon_connection *connection=
+      (Ircon_connection*) my_hash_element(&ircon_connections, i);
+    Ircon_connection_stats *row= &stats[i];
+
+    memcpy(row->endpoint, connection->endpoint, connection->endpoint_length);
+    row->endpoint_length= connection->endpoint_length;
+    row->ref_count= connection->ref_count;
+    mysql_mutex_lock(&connection->mutex);
+    row->state= connection->state;
+    row->breaker= connection->breaker;
+    row->commands_sent= connection->commands_sent;
+    row->bytes_sent= connection->bytes_sent;
+    row->connect_failures= connection->connect_failures;
+    memcpy(row->latency, connection->latency, sizeof(row->latency));
+    row->last_sent_at= connection->last_sent_at;
+    row->send_rate= connection->send_rate *
+                    exp(-(double) (now - connection->send_rate_at) /
+                        (IRCON_RATE_WINDOW * 1000000.0));
+    memcpy(row->last_command, connection->last_command,
+           connection->last_command_length);
+    row->last_command_length= connection->last_command_length;
+    mysql_mutex_unlock(&connection->mutex);
+  }
+  mysql_mutex_unlock(&ircon_connections_mutex);
+
+  for (ulong i= 0; i < count; i++)
+  {
+    Ircon_connection_stats *row= &stats[i];
+    uint last_command_length= row->last_command_length;
+
+    char hex[2 * IRCON_COMMAND_LINE_LENGTH + 1];
+    const char *last_command= row->last_command;
+
+    /* Binary frames are shown in hex */
+    if (last_command_length &&
+        (uchar) row->last_command[0] == IRCON_FRAME_MAGIC)
+    {
+      last_command_length=
+        (uint) (octet2hex(hex, row->last_command, last_command_length) - hex);
+      last_command= hex;
+    }
+    /* The trailing newline is not part of the command */
+    else if (last_command_length &&
+             row->last_command[last_command_length - 1] == '\n')
+      last_command_length--;
+    field[0]->store(row->endpoint, row->endpoint_length, system_charset_info);
+    field[1]->store(state_names[row->state], strlen(state_names[row->state]),
+                    system_charset_info);
+    field[2]->store(row->ref_count, true);
+    field[3]->store(row->commands_sent, true);
+    field[4]->store(row->bytes_sent, true);
+    field[5]->store(row->connect_failures, true);
+    if (row->last_sent_at)
+    {
+      MYSQL_TIME time;
+      thd->variables.time_zone->gmt_sec_to_TIME(&time,
+                                                (my_time_t) row->last_sent_at);
+      field[6]->set_notnull();
+      field[6]->store_time(&time);
+    }
+    else
+      field[6]->set_null();
+    field[7]->store(row->send_rate);
+    ircon_store_percentile(field[8], row->latency, 0.5);
+    ircon_store_percentile(field[9], row->latency, 0.99);
+    field[10]->store(last_command, last_command_length,
+                     system_charset_info);
+    field[11]->store(breaker_names[row->breaker],
+                     strlen(breaker_names[row->breaker]), system_charset_info);
+    ircon_store_percentile(field[12], row->latency, 0.999);
+    if (schema_table_store_record(thd, table))
+      DBUG_RETURN(1);
+  }
+  DBUG_RETURN(0);
+}
+
+static int ircon_devices_init(void *p)
+{
+  ST_SCHEMA_TABLE *schema= (ST_SCHEMA_TABLE*) p;
+  DBUG_ENTER("ircon_devices_init");
+
+  schema->fields_info= ircon_devices_fields_info;
+  schema->fill_table= ircon_devices_fill_table;
+  DBUG_RETURN(0);
+}
+
+static struct st_mysql_information_schema ircon_devices_info=
+{ MYSQL_INFORMATION_SCHEMA_INTERFACE_VERSION };
+
+
+/*
+  INFORMATION_SCHEMA.IRCON_PROFILE: one row per profiled handler call, see
+  ircon_profile.
+*/
+
+static ST_FIELD_INFO ircon_profile_fields_info[]=
+{
+  {"OPERATION", 16, MYSQL_TYPE_STRING, 0, 0, 0, SKIP_OPEN_TABLE},
+  {"CALLS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG, 0,
+   MY_I_S_UNSIGNED, 0, SKIP_OPEN_TABLE},
+  {"LATENCY_P50_NS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {"LATENCY_P99_NS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {"LATENCY_P999_NS", MY_INT64_NUM_DECIMAL_DIGITS, MYSQL_TYPE_LONGLONG,
+   0, MY_I_S_UNSIGNED | MY_I_S_MAYBE_NULL, 0, SKIP_OPEN_TABLE},
+  {0, 0, MYSQL_TYPE_NULL, 0, 0, 0, 0}
+};
+
+static int ircon_profile_fill_table(THD *thd, TABLE_LIST *tables, Item *cond)
+{
+  TABLE *table= tables->table;
+  Field **field= table->field;
+  DBUG_ENTER("ircon_profile_fill_table");
+
+  for (uint i= 0; i < IRCON_OPERATION_COUNT; i++)
+  {
+    ulonglong latency[IRCON_PROFILE_BUCKETS];
+    ulonglong calls= 0;
+
+    for (uint j= 0; j < IRCON_PROFILE_BUCKETS; j++)
+      calls+= latency[j]= my_atomic_load64(&ircon_profile_latency[i][j]);
+    field[0]->store(ircon_operation_names[i],
+                    strlen(ircon_operation_names[i]), system_charset_info);
+    field[1]->store(calls, true);
+    ircon_store_percentile(field[2], latency, 0.5, IRCON_PROFILE_BUCKETS);
+    ircon_store_percentile(field[3], latency, 0.99, IRCON_PROFILE_BUCKETS);
+    ircon_store_percentile(field[4], latency, 0.999, IRCON_PROFILE_BUCKETS);
+    if (schema_table_store_record(thd, table))
+      DBUG_RETURN(1);
+  }
+  DBUG_RETURN(0);
+}
+
+static int ircon_profile_init(void *p)
+{
+  ST_SCHEMA_TABLE *schema= (ST_SCHEMA_TABLE*) p;
+  DBUG_ENTER("ircon_profile_init");
+
+  schema->fields_info= ircon_profile_fields_info;
+  schema->fill_table= ircon_profile_fill_table;
+  DBUG_RETURN(0);
+}
+
+static struct st_mysql_information_schema ircon_profile_info=
+{ MYSQL_INFORMATION_SCHEMA_INTERFACE_VERSION };
+
 mysql_declare_plugin(ircon)
 {
   MYSQL_STORAGE_ENGINE_PLUGIN,
@@ -1146,11 +7298,41 @@ mysql_declare_plugin(ircon)
   "Ircon storage engine",
   PLUGIN_LICENSE_GPL,
   ircon_init_func,                            /* Plugin Init */
-  NULL,                                         /* Plugin Deinit */
+  ircon_done_func,                            /* Plugin Deinit */
   0x0001 /* 0.1 */,
   func_status,                                  /* status variables */
   ircon_system_variables,                     /* system variables */
   NULL,                                         /* config options */
   0,                                            /* flags */
+},
+{
+  MYSQL_INFORMATION_SCHEMA_PLUGIN,
+  &ircon_devices_info,
+  "IRCON_DEVICES",
+  "Brian Aker, MySQL AB",
+  "Ircon device connections and command statistics",
+  PLUGIN_LICENSE_GPL,
+  ircon_devices_init,                           /* Plugin Init */
+  NULL,                                         /* Plugin Deinit */
+  0x0001 /* 0.1 */,
+  NULL,                                         /* status variables */
+  NULL,                                         /* system variables */
+  NULL,                                         /* config options */
+  0,                                            /* flags */
+},
+{
+  MYSQL_INFORMATION_SCHEMA_PLUGIN,
+  &ircon_profile_info,
+  "IRCON_PROFILE",
+  "Brian Aker, MySQL AB",
+  "Ircon handler call latency histograms",
+  PLUGIN_LICENSE_GPL,
+  ircon_profile_init,                           /* Plugin Init */
+  NULL,                                         /* Plugin Deinit */
+  0x0001 /* 0.1 */,
+  NULL,                                         /* status variables */
+  NULL,                                         /* system variables */
+  NULL,                                         /* config options */
+  0,                                            /* flags */
 }
 mysql_declare_plugin_end;
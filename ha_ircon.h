@@ -35,37 +35,534 @@
 #include "thr_lock.h"                    /* THR_LOCK, THR_LOCK_DATA */
 #include "handler.h"                     /* handler */
 #include "my_base.h"                     /* ha_rows */
+#include "mysql/psi/mysql_thread.h"      /* mysql_mutex_t */
+#include "mysql/psi/mysql_socket.h"      /* MYSQL_SOCKET */
+#include "hash.h"                        /* HASH */
+#include "prealloced_array.h"            /* Prealloced_array */
+#include "my_alloc.h"                    /* MEM_ROOT */
+#include "my_atomic.h"                   /* my_atomic_load32 */
+
+#include <sys/socket.h>                  /* sockaddr_storage */
 
-#define IRCON_COMMAND_LENGTH 8
 #define IRCON_COMMAND_MODE "mode"
 #define IRCON_COMMAND_TEMPERATURE "temperature"
 #define IRCON_COMMAND_POWER "power"
 #define IRCON_COMMAND_ANGLE "angle"
 #define IRCON_COMMAND_UNKNOWN "-"
 
+/** @brief
+  The device commands a column can be bound to.
+*/
+enum ircon_command
+{
+  IRCON_COMMAND_ID_MODE,
+  IRCON_COMMAND_ID_TEMPERATURE,
+  IRCON_COMMAND_ID_POWER,
+  IRCON_COMMAND_ID_ANGLE,
+  IRCON_COMMAND_ID_NONE         ///< Not a command, keep last
+};
+
+/* Longest mode or angle value, and longest formatted value of any command */
+#define IRCON_VALUE_LENGTH 32
+
 #define IRCON_DEFAULT_PORT 21000
 
+/* Engine error codes, see ha_ircon::get_error_message() */
+#define IRCON_ERROR_INVALID_VALUE 10000
+#define IRCON_ERROR_CIRCUIT_OPEN 10001
+#define IRCON_ERROR_DICTIONARY_FULL 10002
+
+/*
+  Size of the per-handler buffer a command line is built in before it is
+  sent. Longer lines still work, String falls back to the heap.
+*/
+#define IRCON_COMMAND_LINE_LENGTH 256
+
+/*
+  Binary wire format: IRCON_FRAME_MAGIC, the payload length in one byte,
+  then per command its ircon_command id and value. Temperatures are int16
+  tenths in network byte order, power is one byte (0xff unknown), mode
+  and angle are a length byte and the text. No text line starts with
+  IRCON_FRAME_MAGIC, so a gateway tells the formats apart by the first
+  byte.
+*/
+#define IRCON_FRAME_MAGIC 0x80
+#define IRCON_FRAME_HEADER_LENGTH 2
+/* Id of the sequence number, 8 bytes in network byte order, when pipelined */
+#define IRCON_FRAME_SEQ 0xff
+
+/** @brief
+  How commands are encoded on the wire.
+*/
+enum ircon_wire_format
+{
+  IRCON_WIRE_FORMAT_TEXT,       ///< "name:value,...\n" lines
+  IRCON_WIRE_FORMAT_BINARY      ///< IRCON_FRAME_MAGIC frames
+};
+
+/*
+  Longest canonical "host:port" or "[v6]:port" endpoint with its
+  terminator: the longest device key plus brackets and ":65535"
+*/
+#define IRCON_ENDPOINT_LENGTH 264
+
+/** @brief
+  State of a connection to a device.
+*/
+enum ircon_connection_state
+{
+  IRCON_CONNECTION_CLOSED,      ///< Not connected yet or after an error
+  IRCON_CONNECTION_CONNECTING,  ///< Non-blocking connect() in progress
+  IRCON_CONNECTION_CONNECTED,
+  IRCON_CONNECTION_FAILED       ///< Last connect attempt failed
+};
+
+/** @brief
+  Circuit breaker of a connection, see ircon_breaker_threshold.
+*/
+enum ircon_breaker_state
+{
+  IRCON_BREAKER_CLOSED,         ///< Commands are sent
+  IRCON_BREAKER_OPEN,           ///< Commands fail until the next health check
+  IRCON_BREAKER_HALF_OPEN       ///< A health check connect is in progress
+};
+
+/*
+  Send latency histograms: bucket i counts sends that took less than 2^i
+  microseconds, the last bucket all slower ones.
+*/
+#define IRCON_LATENCY_BUCKETS 22
+
+class Ircon_event_loop;
+
+/** @brief
+  A connection to one device endpoint. Connections live in an engine-wide
+  pool keyed by endpoint, so every table naming the same device uses the
+  same socket and it survives table cache evictions. Unused connections
+  are kept open for ircon_pool_max_idle seconds. The endpoint is looked up
+  in the resolver cache on every connect, so a host name that moves is
+  followed on the next reconnect.
+
+  @details
+  Synchronous commands are written by the client thread. Asynchronous ones
+  are appended to output and written by the event loop the connection is
+  assigned to, which also completes connects started for them, notices
+  hangups and times out connects that take too long.
+*/
+class Ircon_connection
+{
+public:
+  char endpoint[IRCON_ENDPOINT_LENGTH];   ///< Pool key
+  uint endpoint_length;
+  struct sockaddr_storage addr; ///< Resolved when connecting
+  socklen_t addr_length;
+  mysql_mutex_t mutex;     ///< Protects the socket and the connection state
+  MYSQL_SOCKET socket;
+  enum ircon_connection_state state;
+  /* Shares, statements and scheduled commands using it, under the pool mutex */
+  uint ref_count;
+  ulonglong idle_since;    ///< my_micro_time() when ref_count dropped to 0
+  volatile int32 queued;   ///< Commands in output not written yet
+  Ircon_event_loop *loop;
+  /* In the loop's list of its connections, protected by the loop's mutex */
+  Ircon_connection *loop_next;
+  Ircon_connection *loop_prev;
+  Ircon_connection *next_retired; ///< In the loop's list of connections to free
+  mysql_cond_t drained;    ///< Signalled when output has been written
+  uchar *output;           ///< Asynchronous commands, protected by mutex
+  size_t output_size;
+  size_t output_start;     ///< First byte not written yet
+  size_t output_end;
+  int blocking_flags;      ///< fcntl() flags to restore after a connect
+  ulonglong connect_deadline; ///< my_micro_time() a pending connect fails at
+  bool registered;         ///< The socket is in the loop's epoll set
+  uint32 events;           ///< epoll events registered for the socket
+  /* Lines ever queued in output, and those written or dropped of them */
+  ulonglong output_seq;
+  ulonglong written_seq;
+  ulonglong dropped_seq;
+  /* Journal records of the lines in output, see ircon_journal_file */
+  size_t *journal_records;
+  uint journal_record_count;
+  uint journal_record_size;
+
+  /* Circuit breaker, protected by mutex */
+  enum ircon_breaker_state breaker;
+  uint consecutive_failures; ///< Connect failures since the last success
+  ulonglong probe_at;      ///< my_micro_time() of the next health check
+
+  /* Pipelined commands, see ircon_pipeline_window; protected by mutex */
+  ulonglong next_seq;      ///< Sequence number of the next command
+  ulonglong acked_seq;     ///< Highest sequence number acknowledged
+  ulonglong lost_seq;      ///< Commands up to this one will not be acked
+  char ack_buffer[IRCON_COMMAND_LINE_LENGTH]; ///< Partial line read so far
+  uint ack_length;
+
+  /* State query of query_line(), answered through the loop; under mutex */
+  bool querying;           ///< A query is in flight, others wait for it
+  int query_result;        ///< -1 until answered, or the error it failed with
+  char query_response[IRCON_COMMAND_LINE_LENGTH];
+  size_t query_response_length;
+
+  /* Statistics of this endpoint, protected by mutex */
+  ulonglong commands_sent;
+  ulonglong bytes_sent;
+  ulonglong connect_failures;
+  bool ever_connected;
+  ulonglong latency[IRCON_LATENCY_BUCKETS]; ///< Send latency histogram
+  time_t last_sent_at;
+  double send_rate;         ///< Commands per second, decaying over a minute
+  ulonglong send_rate_at;   ///< my_micro_time() send_rate was updated at
+  char last_command[IRCON_COMMAND_LINE_LENGTH];
+  uint last_command_length;
+
+  /*
+    Rate limit, see ircon_rate_limit. rate_tat is updated lock-free, the
+    deferred line is protected by mutex.
+  */
+  volatile int64 rate_tat; ///< my_micro_time() the bucket is full again at
+  volatile int32 deferred; ///< 1 while deferred_line waits for a token
+  ulong deferred_rate;     ///< Rate limit deferred_line was deferred under
+  char *deferred_line;
+  size_t deferred_length;
+  size_t deferred_size;    ///< Allocated for deferred_line
+  /* Deferred lines are numbered for wait_deferred() */
+  ulonglong deferred_ticket; ///< Of the line deferred, or the last one
+  ulonglong released_ticket; ///< Last line queued or dropped
+  ulonglong released_line; ///< Output line it was queued as, 0 if dropped
+
+  Ircon_connection(const char *endpoint_arg, uint length);
+  ~Ircon_connection();
+
+  int connect_device();
+  int start_connect();
+  void disconnect();
+  int send_line(const char *line, size_t length, int *calls);
+  int queue_line(const char *line, size_t length, int unbatched_calls,
+                 ulonglong *seq, ulonglong *written);
+  bool admit(ulong rate);
+  int defer_line(const char *line, size_t length, ulong rate,
+                 ulonglong *ticket);
+  void release_deferred(ulonglong now);
+  int wait_deferred(ulonglong ticket);
+  void queue_scheduled(const char *line, size_t length, ulong rate);
+  int wait_ack(ulonglong seq);
+  int wait_written(ulonglong line);
+  int query_line(const char *line, size_t length, char *response,
+                 size_t size, size_t *response_length);
+  void handle_events(uint32 ready);
+  void check_timeout(ulonglong now);
+  bool breaker_open() const { return breaker != IRCON_BREAKER_CLOSED; }
+
+private:
+  int finish_connect();
+  int connect_failed();
+  int send_all(const char *line, size_t length, int *calls);
+  int append_output(const char *line, size_t length, int unbatched_calls,
+                    ulonglong *seq, ulonglong *written, bool command= true);
+  bool take_token(ulong rate, ulonglong now);
+  void write_output(bool wait);
+  void read_input();
+  void lose_unacked();
+  void drop_output();
+  void journal_line(const char *line, size_t length);
+  void complete_journal();
+  void update_events();
+  void account_sent(ulonglong commands, size_t bytes, ulonglong now);
+};
+
+uint ircon_canonical_endpoint(const char *name, uint length, char *endpoint);
+Ircon_connection *ircon_acquire_connection(const char *endpoint, uint length);
+void ircon_retain_connection(Ircon_connection *connection);
+void ircon_release_connection(Ircon_connection *connection);
+int ircon_send_command(Ircon_connection *connection, const char *line,
+                       size_t length, int unbatched_calls, ulonglong *seq,
+                       ulonglong *written);
+
+/*
+  A table whose PRIMARY KEY is a single column with this name holds one row
+  per device, the column value being the device's "host:port". Other tables
+  control the one device named by the table name.
+*/
+#define IRCON_COLUMN_DEVICE "device"
+
+/*
+  A DATETIME or TIMESTAMP column with this name schedules the commands of
+  a row written with a future value for that time, see Ircon_scheduler.
+*/
+#define IRCON_COLUMN_SCHEDULE "send_at"
+
+/* Longest device key accepted in multi-device tables */
+#define IRCON_MAX_KEY_LENGTH 255
+
+/** @brief
+  Device state of a table as a struct of arrays indexed by device slot.
+
+  @details
+  Each command has a dense typed column: mode and angle are codes into a
+  small dictionary of the values seen so far (255 at most, see
+  value_code()), temperature is in tenths of
+  a degree and power is on or off. A device costs 5 bytes, and scans over
+  one command touch contiguous memory. The columns are carved out of one
+  block of the store's arena and reallocated there when the table grows.
+*/
+class Ircon_state_store
+{
+public:
+  uchar *mode;             ///< Dictionary code, 0 is unknown
+  int16 *temperature;      ///< Tenths of a degree
+  int8 *power;             ///< 1 on, 0 off
+  uchar *angle;            ///< Dictionary code, 0 is unknown
+  int32 *version;          ///< Raised by every change, starts at 1
+  uint capacity;
+
+  static const int16 TEMPERATURE_UNKNOWN= INT_MIN16;
+  static const int8 POWER_UNKNOWN= -1;
+
+  Ircon_state_store();
+  ~Ircon_state_store();
+
+  bool reserve(uint slots);
+  void reset(uint slot);
+  int parse(enum ircon_command command, const char *value, size_t length,
+            int *code);
+  void assign(uint slot, enum ircon_command command, int code);
+  int code(uint slot, enum ircon_command command) const;
+  int32 state_version(uint slot) const
+  { return my_atomic_load32(&version[slot]); }
+  bool known(uint slot, enum ircon_command command) const;
+  size_t get(uint slot, enum ircon_command command, char *buf) const;
+  size_t format(enum ircon_command command, int code, char *buf) const;
+  void gather(uint first, uint count, enum ircon_command command,
+              int *codes) const;
+  size_t encode(uint slot, enum ircon_command command, uchar *buf) const;
+
+private:
+  MEM_ROOT arena;
+  mysql_mutex_t dictionary_mutex;  ///< Serializes adding dictionary values
+  const char *values[256]; ///< Dictionary, values[0] is IRCON_COMMAND_UNKNOWN
+  uchar value_lengths[256];
+  uint value_count;
+
+  int value_code(const char *value, size_t length, int *code);
+};
+
+/* State file of a table, holding the last known state of its devices */
+#define IRCON_STATE_EXT ".IRS"
+#define IRCON_STATE_MAGIC "IRCONS01"
+#define IRCON_STATE_MAGIC_LENGTH 8
+/* Longest device key a state file keeps */
+#define IRCON_STATE_NAME_LENGTH 64
+
+/** @brief
+  The state of one device slot in a state file.
+*/
+struct Ircon_state_record
+{
+  uchar used;
+  uchar name_length;
+  uchar mode_length;
+  uchar angle_length;
+  int16 temperature;
+  int8 power;
+  uchar reserved;
+  char name[IRCON_STATE_NAME_LENGTH];
+  char mode[IRCON_VALUE_LENGTH];
+  char angle[IRCON_VALUE_LENGTH];
+};
+
+/** @brief
+  Memory mapped state file of a table: a header and one Ircon_state_record
+  per device slot. Records are rewritten in place as device state changes,
+  and left to the page cache; the file is synced when the share closes.
+*/
+class Ircon_state_file
+{
+public:
+  Ircon_state_file();
+  ~Ircon_state_file();
+
+  bool open(const char *path);
+  uint slots() const { return slot_count; }
+  const Ircon_state_record *record(uint slot) const
+  { return (const Ircon_state_record*) (map + header_length()) + slot; }
+  void save(uint slot, const char *name, uint name_length,
+            const Ircon_state_store *state);
+  void clear(uint slot);
+
+private:
+  mysql_mutex_t mutex;     ///< Serializes writes and remapping
+  File file;
+  uchar *map;              ///< NULL if the table has no state file
+  size_t size;
+  uint slot_count;         ///< Records the mapping holds
+
+  static size_t header_length() { return IRCON_STATE_MAGIC_LENGTH + 8; }
+  bool grow(uint slots);
+};
+
+/** @brief
+  One device of a table: the row a scan returns. Its state is in the
+  share's Ircon_state_store at the device's slot.
+*/
+class Ircon_device
+{
+public:
+  uint slot;                 ///< Position in Ircon_share::devices
+  ulonglong id;              ///< Unique in the share, tells reused slots apart
+  ulonglong batch_id;        ///< Statement batch the device is queued in
+  uint batch_commands;       ///< Bitmap of the ircon_commands batched
+  time_t sent_at[IRCON_COMMAND_ID_NONE]; ///< When each command was last sent
+  volatile int64 state_read_at; ///< my_micro_time() of the last read back
+  char *name;                ///< Device key, the table name for single tables
+  uint name_length;
+  Ircon_connection *connection;
+  mysql_mutex_t mutex;       ///< Orders the state changes and commands sent
+  Ircon_device *next_retired; ///< In Ircon_share::retired_devices
+  /*
+    The row of the device as a record image, see ha_ircon::fill_record().
+    image_seq is a seqlock, odd while the image is rebuilt.
+  */
+  uchar *image;
+  volatile int32 image_seq;
+  volatile int32 image_version; ///< State version of the image, 0 for none
+};
+
 /** @brief
   Ircon_share is a class that will be shared among all open handlers.
   This ircon implements the minimum of what you will probably need.
+
+  @details
+  The devices live in a slot array so that a slot number can serve as row
+  position; deleted devices leave a NULL slot that is reused by the next
+  insert. device_index maps device keys to devices.
+
+  Writers only take TL_WRITE_ALLOW_WRITE, see ha_ircon::store_lock(), so
+  several statements change the share at once. devices_mutex serializes
+  changes to the device list; a grown devices array is allocated from
+  devices_arena and the old one kept, so scans read it without locking.
+  Each device's mutex orders the changes to its state and the commands
+  sent for them, so writes to different devices run in parallel. The
+  state columns are only moved by Ircon_state_store::reserve() under
+  state_lock, which writers of the state take shared. A device whose key
+  an UPDATE changed may still be in use by another statement; it is kept
+  in retired_devices until no handler of the share is locked, see
+  reclaim_devices(). Only DELETE and REPLACE, which lock multi-device
+  tables exclusively, free devices right away.
 */
 class Ircon_share : public Handler_share {
 public:
   THR_LOCK lock;
-  int socket;
-  bool socket_opened;
-
-  char state_mode[8];
-  char state_temperature[8];
-  char state_power[8];
-  char state_angle[8];
+  bool multi_device;       ///< Rows are devices keyed by device_field
+  long dedup_ttl;          ///< dedup_ttl of the table COMMENT, or -1
+  int wire_format;         ///< wire_format of the table COMMENT, or -1
+  long rate_limit;         ///< rate_limit of the table COMMENT, or -1
+  int schedule_field;      ///< Field index of the send_at column, or -1
+  uint device_field;       ///< Field index of the device column
+
+  Ircon_device **devices;
+  Ircon_device *retired_devices; ///< Protected by devices_mutex
+  volatile int32 locked;   ///< Handlers between external_lock() and unlock
+  uint devices_size;       ///< Allocated slots
+  uint device_slots;       ///< Slots in use, including freed ones
+  uint device_count;
+  ulonglong next_device_id;
+  HASH device_index;
+  mysql_mutex_t devices_mutex;
+  mysql_rwlock_t state_lock;
+  Ircon_state_store state;
+  Ircon_state_file state_file;
 
   Ircon_share();
+  ~Ircon_share();
+
+  int init(TABLE_SHARE *table_share);
+  Ircon_device *find_device(const char *name, uint length);
+  int add_device(const char *name, uint length, Ircon_device **device);
+  void remove_device(Ircon_device *device);
+  void retire_device(Ircon_device *device);
+  void reclaim_devices();
+  void save_state(Ircon_device *device);
+  void forget_state(Ircon_device *device);
+
+private:
+  MEM_ROOT devices_arena;
+
+  void unlink_device(Ircon_device *device);
+  void load_state();
+};
 
-  ~Ircon_share()
-  {
-    thr_lock_delete(&lock);
-  }
+bool ircon_is_multi_device(TABLE_SHARE *table_share);
+
+/** @brief
+  A device queued in a statement batch. The id catches devices deleted,
+  and their slot reused, before the batch is sent.
+*/
+struct Ircon_pending_device
+{
+  uint slot;
+  ulonglong id;
+};
+
+/** @brief
+  The commands of a row written, parsed before any device is touched.
+*/
+struct Ircon_row_commands
+{
+  uint commands;           ///< Bitmap of the commands written
+  int codes[IRCON_COMMAND_ID_NONE]; ///< State codes of those commands
+  ulonglong due;           ///< my_micro_time() to send at, 0 for now
+};
+
+/** @brief
+  The last command a statement queued to a connection, waited for when the
+  statement ends: until it is acked if it was pipelined, written otherwise.
+  It holds a reference to the connection, which the device that sent the
+  command may no longer hold by then.
+*/
+struct Ircon_pending_ack
+{
+  Ircon_connection *connection;
+  ulonglong seq;           ///< Pipeline sequence number, or 0
+  ulonglong written;       ///< Output line number, used if seq is 0
+  ulonglong deferred;      ///< Ticket of a rate limited line, or 0
+};
+
+/** @brief
+  Per connection state of the statement running in it, kept with
+  thd_set_ha_data(). The commands of every IRCON table of the statement
+  are queued to their connections, so that the event loops write them in
+  parallel, and waited for once the last of the tables is unlocked.
+*/
+class Ircon_statement
+{
+public:
+  uint tables_locked;      ///< IRCON tables external_lock()ed
+  Prealloced_array<Ircon_pending_ack, 16, true> pending_acks;
+
+  Ircon_statement();
+  ~Ircon_statement();
+
+  int add(Ircon_connection *connection, ulonglong seq, ulonglong written,
+          ulonglong deferred= 0);
+  int wait();
+};
+
+/* Slots a pushed condition is evaluated for at a time */
+#define IRCON_FILTER_BLOCK 64
+
+/** @brief
+  A conjunct of the condition pushed with ha_ircon::cond_push() that reads
+  one column of the table. Its result for each value of a command column
+  is memoized in ha_ircon::filter_memo from memo_offset on.
+*/
+struct Ircon_pushed_predicate
+{
+  Item *cond;
+  Field *field;
+  enum ircon_command command; ///< Of the column, IRCON_COMMAND_ID_NONE if none
+  bool device_key;         ///< The column is the device key
+  uint memo_offset;
 };
 
 /** @brief
@@ -77,7 +574,56 @@ class ha_ircon: public handler
   Ircon_share *share;    ///< Shared lock info
   Ircon_share *get_share(); ///< Get the share
 
-  bool next_is_eof;
+  uint current_slot;       ///< Next slot of a table or index scan
+  Ircon_device *current_device;  ///< Device of the last row read
+
+  char command_line_buffer[IRCON_COMMAND_LINE_LENGTH];
+  String command_line;     ///< One command line or frame, sent at once
+
+  /* Devices with batched state not yet sent */
+  Prealloced_array<Ircon_pending_device, 16, true> pending_devices;
+  ulonglong batch_id;
+  bool bulk_insert;        ///< Between start_bulk_insert() and its end
+  const char *error_field; ///< Column of an IRCON_ERROR_INVALID_VALUE
+  const char *error_endpoint; ///< Endpoint of an IRCON_ERROR_CIRCUIT_OPEN
+  /* The ircon_command of each column by field index, set up in open() */
+  uchar *field_commands;
+  /* Field indexes of the command columns, in table order */
+  uint *command_fields;
+  uint command_field_count;
+
+  /* Pushed condition, see cond_push() */
+  Prealloced_array<Ircon_pushed_predicate, 4, true> pushed_predicates;
+  int8 *filter_memo;       ///< 1 true, 0 false, -1 not evaluated yet
+  uint filter_memo_size;   ///< Allocated
+  uint filter_memo_used;
+  uint filter_block;       ///< First slot filter_mask is for, or UINT_MAX
+  ulonglong filter_mask;   ///< Slots of the block that pass the condition
+  bool filter_state;       ///< Command columns are filtered on
+  ulonglong scan_start;    ///< Of the scan being profiled, see ircon_profile
+
+  int build_command(Ircon_device *device, uint commands);
+  int flush_command(Ircon_device *device, uint commands, bool fan_out);
+  int schedule_command(Ircon_device *device, uint commands, ulonglong due);
+  int flush_pending(void);
+  int send_command(Ircon_connection *connection, const char *line,
+                   size_t length, int unbatched_calls, bool fan_out);
+  int defer_command(Ircon_connection *connection, const char *line,
+                    size_t length, ulong rate);
+  int end_statement(bool unlock);
+  int parse_row(const uchar *old_data, Ircon_row_commands *row);
+  int write_update_row(Ircon_device *device, const Ircon_row_commands *row);
+  void device_key(const uchar *record, String *key);
+  Ircon_device *find_device(const uchar *record);
+  void read_back_state(Ircon_device *device);
+  void fill_record(uchar *buf, Ircon_device *device);
+  void store_fields(uchar *buf, Ircon_device *device, bool all_columns);
+  int next_device(uchar *buf);
+  bool push_predicate(Item *cond);
+  void start_filter();
+  bool evaluate_predicate(Ircon_pushed_predicate *predicate,
+                          const char *value, size_t length);
+  ulonglong filter_slots(uint first, uint count);
 
 public:
   ha_ircon(handlerton *hton, TABLE_SHARE *table_arg);
@@ -111,8 +657,11 @@ public:
       We are saying that this engine is just statement capable to have
       an engine that can only handle statement-based logging. This is
       used in testing.
+
+      The device count info() reports is exact, which lets the optimizer
+      read a table of one device as a constant and answer COUNT(*) from it.
     */
-    return HA_BINLOG_STMT_CAPABLE;
+    return HA_BINLOG_STMT_CAPABLE | HA_STATS_RECORDS_IS_EXACT;
   }
 
   /** @brief
@@ -127,7 +676,8 @@ public:
   */
   ulong index_flags(uint inx, uint part, bool all_parts) const
   {
-    return 0;
+    /* The device key is a hash index: exact lookups only */
+    return HA_ONLY_WHOLE_INDEX | HA_KEY_SCAN_NOT_ROR;
   }
 
   /** @brief
@@ -148,7 +698,7 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_keys()          const { return 0; }
+  uint max_supported_keys()          const { return 1; }
 
   /** @brief
     unireg.cc will call this to make sure that the storage engine can handle
@@ -159,7 +709,7 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_key_parts()     const { return 0; }
+  uint max_supported_key_parts()     const { return 1; }
 
   /** @brief
     unireg.cc will call this to make sure that the storage engine can handle
@@ -170,18 +720,17 @@ public:
     There is no need to implement ..._key_... methods if your engine doesn't
     support indexes.
    */
-  uint max_supported_key_length()    const { return 0; }
+  uint max_supported_key_length()    const { return IRCON_MAX_KEY_LENGTH; }
 
   /** @brief
     Called in test_quick_select to determine if indexes should be used.
   */
-  virtual double scan_time() { return (double) (stats.records+stats.deleted) / 20.0+10; }
+  virtual double scan_time();
 
   /** @brief
     This method will never be called if you do not implement indexes.
   */
-  virtual double read_time(uint, uint, ha_rows rows)
-  { return (double) rows /  20.0+1; }
+  virtual double read_time(uint index, uint ranges, ha_rows rows);
 
   /*
     Everything below are methods that we implement in ha_ircon.cc.
@@ -203,7 +752,6 @@ public:
     We implement this in ha_ircon.cc. It's not an obligatory method;
     skip it and and MySQL will treat it as not implemented.
   */
-  int write_update_row(void);
   int init_writer(const char *ip);
   int write_row(uchar *buf);
 
@@ -219,6 +767,8 @@ public:
   */
   int delete_row(const uchar *buf);
 
+  bool get_error_message(int error, String *buf);
+
   /** @brief
     We implement this in ha_ircon.cc. It's not an obligatory method;
     skip it and and MySQL will treat it as not implemented.
@@ -226,6 +776,9 @@ public:
   int index_read_map(uchar *buf, const uchar *key,
                      key_part_map keypart_map, enum ha_rkey_function find_flag);
 
+  int index_init(uint idx, bool sorted);
+  int index_end();
+
   /** @brief
     We implement this in ha_ircon.cc. It's not an obligatory method;
     skip it and and MySQL will treat it as not implemented.
@@ -265,7 +818,12 @@ public:
   void position(const uchar *record);                           ///< required
   int info(uint);                                               ///< required
   int extra(enum ha_extra_function operation);
+  int reset();
+  const Item *cond_push(const Item *cond);
+  void cond_pop();
   int external_lock(THD *thd, int lock_type);                   ///< required
+  void start_bulk_insert(ha_rows rows);
+  int end_bulk_insert();
   int delete_all_rows(void);
   int truncate();
   ha_rows records_in_range(uint inx, key_range *min_key,